@@ -1,5 +1,6 @@
 Param (
-	[switch]$wat
+	[switch]$wat,
+	[switch]$threads
 )
 
 if (!(Test-Path -Path build)) { mkdir build }
@@ -12,7 +13,15 @@ clang -g -O0 -D_DEBUG --target=wasm32 -msimd128 -mbulk-memory -nostdlib `
 "-Wl,--no-entry,--reproduce=binary.wasm.map" `
 -Wno-incompatible-library-redeclaration -Wno-switch `
 -o binary.wasm `
-../src/main.c ../src/memory.c ../src/tokenizer.c ../src/parser.c ../src/code_gen.c ../src/code_gen_wat.c
+../src/main.c ../src/memory.c ../src/tokenizer.c ../src/parser.c ../src/optimizer.c ../src/code_gen.c ../src/code_gen_wat.c
+
+} elseif ($threads) {
+
+clang -g -O0 -D_DEBUG --target=wasm32 -msimd128 -mbulk-memory -matomics -nostdlib `
+"-Wl,--no-entry,--shared-memory,--import-memory,--max-memory=1073741824,--export=__stack_pointer" `
+-Wno-incompatible-library-redeclaration -Wno-switch `
+-o binary_threads.wasm `
+../src/main.c ../src/memory.c ../src/tokenizer.c ../src/parser.c ../src/optimizer.c ../src/code_gen.c ../src/code_gen_wasm.c ../src/peephole.c
 
 } else {
 
@@ -20,7 +29,7 @@ clang -g -O0 -D_DEBUG --target=wasm32 -msimd128 -mbulk-memory -nostdlib `
 "-Wl,--no-entry,--reproduce=binary.wasm.map" `
 -Wno-incompatible-library-redeclaration -Wno-switch `
 -o binary.wasm `
-../src/main.c ../src/memory.c ../src/tokenizer.c ../src/parser.c ../src/code_gen.c ../src/code_gen_wasm.c
+../src/main.c ../src/memory.c ../src/tokenizer.c ../src/parser.c ../src/optimizer.c ../src/code_gen.c ../src/code_gen_wasm.c ../src/peephole.c
 
 }
 
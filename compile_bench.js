@@ -0,0 +1,95 @@
+"use strict";
+
+import compiler from "./compiler.js";
+
+// Times compiling a small program right after compiling another small program,
+// then right after compiling a large one. Starting a compile only rewinds the
+// arena, so the two should take about as long. Then compares the tree path
+// with direct emit on a program with many functions, by time and output size.
+
+const RUNS = 50;
+
+const ctx = compiler.create_compiler_ctx();
+
+const small_source = `int fib(int n) {
+	if (n < 2) return n;
+	return fib(n - 1) + fib(n - 2);
+}
+int main() {
+	return fib(10);
+}
+`;
+
+const generate_source = (statement_count) => {
+	const statements = [];
+	for (let i = 0; i < statement_count; ++i) {
+		statements.push(`\ttotal = total + ${i % 7} * 3; // generated statement ${i}\n`);
+	}
+	return `int main() {\n\tint total = 0;\n${statements.join("")}\treturn total;\n}\n`;
+};
+
+// a few functions of statement_count statements each, the sections in front
+// of the code still count functions in a single byte
+const generate_functions = (statement_count) => {
+	const functions = [];
+	for (let i = 0; i < 16; ++i) {
+		const statements = [];
+		for (let j = 0; j < statement_count; ++j) {
+			statements.push(`\t\tif (j / 2 * 2 == j) total = total + *(p + 1) - (j + ${j % 5}) * 3;\n\t\telse total = total - ${j % 3};\n`);
+		}
+		functions.push(`int f${i}(int a, int *p) {\n\tint total = a * 2 + 3 * 4;\n\tfor (int j = 0; j < a; j = j + 1) {\n${statements.join("")}\t}\n\treturn total;\n}\n`);
+	}
+	return `${functions.join("")}int main() {\n\tint x = 5;\n\tint y = 6;\n\treturn f0(3, &y);\n}\n`;
+};
+
+const compile = (source) => {
+	const ptr = compiler.bump_alloc_src_code(ctx, source.length + 1);
+	new Uint8Array(compiler.memory.buffer, ptr, source.length + 1).set(source);
+	return compiler.compile(ctx, ptr, source.length + 1);
+};
+
+const output_size = (compile_result_ptr) => {
+	return new Uint32Array(compiler.memory.buffer, compile_result_ptr, 1)[0];
+};
+
+const best_of_mode = (source, direct_emit) => {
+	compiler.set_direct_emit(ctx, direct_emit);
+	let best = Infinity;
+	let size = 0;
+	for (let i = 0; i < RUNS; ++i) {
+		const start = performance.now();
+		size = output_size(compile(source));
+		best = Math.min(best, performance.now() - start);
+	}
+	compiler.set_direct_emit(ctx, false);
+	return { best, size };
+};
+
+const best_of = (previous_source, source) => {
+	let best = Infinity;
+	for (let i = 0; i < RUNS; ++i) {
+		compile(previous_source);
+		const start = performance.now();
+		compile(source);
+		best = Math.min(best, performance.now() - start);
+	}
+	return best;
+};
+
+export default function run_compile_benchmark() {
+	const encoder = new TextEncoder("utf-8");
+	const small = encoder.encode(small_source);
+	const large = encoder.encode(generate_source(100000));
+
+	const after_small = best_of(small, small);
+	const after_large = best_of(large, small);
+
+	console.log(`compiling ${small.length} bytes after ${small.length} bytes: ${after_small.toFixed(3)}ms`);
+	console.log(`compiling ${small.length} bytes after ${(large.length / (1024 * 1024)).toFixed(1)}MB: ${after_large.toFixed(3)}ms`);
+
+	const functions = encoder.encode(generate_functions(2000));
+	const tree = best_of_mode(functions, false);
+	const direct = best_of_mode(functions, true);
+	console.log(`tree path on ${(functions.length / 1024).toFixed(0)}KB: ${tree.best.toFixed(3)}ms, ${tree.size} bytes`);
+	console.log(`direct emit on ${(functions.length / 1024).toFixed(0)}KB: ${direct.best.toFixed(3)}ms, ${direct.size} bytes`);
+}
@@ -0,0 +1,160 @@
+"use strict";
+
+// Times lexing a generated 10MB+ source on one thread, then split into chunks
+// across 1..N workers, and the same for compiling its functions. Needs
+// build/binary_threads.wasm (compile.ps1 -threads) and a cross-origin isolated
+// page, otherwise shared memory isn't available.
+
+const MAX_WORKERS = 16;
+const CHUNKS_PER_WORKER = 4;
+const RUNS = 5;
+
+const post = (worker, message) => new Promise((resolve) => {
+	worker.onmessage = () => resolve();
+	worker.postMessage(message);
+});
+
+const generate_source = (min_length) => {
+	let parts = [];
+	let length = 0;
+	for (let i = 0; length < min_length; ++i) {
+		const part =
+`int function${i}(int a, int b) {
+	/* generated function ${i} */
+	int total = 0;
+	for (int j = 0; j < a; j = j + 1) {
+		total = total + b * j; // accumulate
+	}
+	return total;
+}
+`;
+		parts.push(part);
+		length += part.length;
+	}
+	return parts.join("");
+};
+
+// the pages the module's memory import asks for at least, which grows with its static data
+const memory_import_minimum = (bytes) => {
+	let i = 8;
+	const read_integer = () => {
+		let value = 0;
+		for (let shift = 0; ; shift += 7) {
+			const byte = bytes[i++];
+			value += (byte & 0x7f) * 2 ** shift;
+			if (!(byte & 0x80)) return value;
+		}
+	};
+	const skip_name = () => {
+		const length = read_integer();
+		i += length;
+	};
+	const skip_limits = () => {
+		const flags = bytes[i++];
+		const minimum = read_integer();
+		if (flags & 1) read_integer();
+		return minimum;
+	};
+
+	while (i < bytes.length) {
+		const id = bytes[i++];
+		const size = read_integer();
+		if (id != 2) {
+			i += size;
+			continue;
+		}
+		for (let count = read_integer(); count > 0; --count) {
+			skip_name();
+			skip_name();
+			const kind = bytes[i++];
+			if (kind == 0) read_integer();
+			else if (kind == 1) { i++; skip_limits(); }
+			else if (kind == 2) return skip_limits();
+			else i += 2;
+		}
+		break;
+	}
+	return 1;
+};
+
+export default async function run_lexer_benchmark() {
+	if (!self.crossOriginIsolated) {
+		console.log("The lexer benchmark needs shared memory, serve the page with COOP/COEP headers");
+		return;
+	}
+
+	const bytes = new Uint8Array(await (await fetch("./build/binary_threads.wasm")).arrayBuffer());
+	const module = await WebAssembly.compile(bytes);
+	const memory = new WebAssembly.Memory({ initial: memory_import_minimum(bytes), maximum: 16384, shared: true });
+	const { exports } = await WebAssembly.instantiate(module, { env: { memory } });
+	const ctx = exports.create_compiler_ctx();
+
+	const source = new TextEncoder("utf-8").encode(generate_source(10 * 1024 * 1024));
+
+	const load_source = () => {
+		const ptr = exports.bump_alloc_src_code(ctx, source.length + 1);
+		new Uint8Array(memory.buffer, ptr, source.length + 1).set(source);
+		return ptr;
+	};
+
+	// prepare runs on the freshly loaded source before the clock starts
+	const best_of = async (run, prepare = () => {}) => {
+		let best = Infinity;
+		for (let i = 0; i < RUNS; ++i) {
+			const ptr = load_source();
+			prepare(ptr);
+			const start = performance.now();
+			await run(ptr);
+			best = Math.min(best, performance.now() - start);
+		}
+		return best;
+	};
+
+	const worker_count = Math.min(navigator.hardwareConcurrency || 4, MAX_WORKERS);
+	const workers = [];
+	for (let i = 0; i < worker_count; ++i) {
+		const worker = new Worker("./lexer_worker.js");
+		await post(worker, { module, memory });
+		workers.push(worker);
+	}
+
+	const megabytes = source.length / (1024 * 1024);
+	const serial = await best_of(async (ptr) => exports.tokenize(ctx, ptr, source.length + 1));
+	console.log(`lexing ${megabytes.toFixed(1)}MB`);
+	console.log(`serial: ${serial.toFixed(1)}ms (${(megabytes * 1000 / serial).toFixed(0)}MB/s)`);
+
+	for (let active = 1; active <= worker_count; active *= 2) {
+		const time = await best_of(async (ptr) => {
+			const chunk_count = exports.lex_parallel_begin(ctx, ptr, source.length + 1, active * CHUNKS_PER_WORKER);
+			const assigned = Array.from({ length: active }, () => []);
+			for (let i = 0; i < chunk_count; ++i) {
+				assigned[i % active].push(i);
+			}
+			await Promise.all(assigned.map((chunks, i) => post(workers[i], { task: "lex_chunk", ctx, chunks })));
+			exports.lex_parallel_end(ctx);
+		});
+		console.log(`${active} worker(s): ${time.toFixed(1)}ms (${(serial / time).toFixed(2)}x serial)`);
+	}
+
+	// every run loads the source again, so no function comes from the last module's cache
+	const lex = (ptr) => exports.tokenize(ctx, ptr, source.length + 1);
+	const compile_serial = await best_of(async () => exports.recompile(ctx), lex);
+	console.log(`compiling the functions serially: ${compile_serial.toFixed(1)}ms`);
+
+	for (let active = 1; active <= worker_count; active *= 2) {
+		const time = await best_of(async () => {
+			const chunk_count = exports.compile_parallel_begin(ctx, active * CHUNKS_PER_WORKER);
+			const assigned = Array.from({ length: active }, () => []);
+			for (let i = 0; i < chunk_count; ++i) {
+				assigned[i % active].push(i);
+			}
+			await Promise.all(assigned.map((chunks, i) => post(workers[i], { task: "compile_chunk", ctx, chunks })));
+			exports.compile_parallel_end(ctx);
+		}, lex);
+		console.log(`compiling the functions on ${active} worker(s): ${time.toFixed(1)}ms (${(compile_serial / time).toFixed(2)}x serial)`);
+	}
+
+	for (const worker of workers) {
+		worker.terminate();
+	}
+}
@@ -0,0 +1,22 @@
+"use strict";
+
+// Worker side of lexer_bench.js: instantiates the threaded compiler on the
+// shared memory, then runs the task it's sent (lex_chunk or compile_chunk) on
+// the context and chunk indices that come with it.
+
+let exports = null;
+
+onmessage = async ({ data }) => {
+	if (data.module) {
+		const instance = await WebAssembly.instantiate(data.module, { env: { memory: data.memory } });
+		exports = instance.exports;
+		exports.__stack_pointer.value = exports.worker_stack_top();
+		postMessage(null);
+		return;
+	}
+
+	for (const chunk of data.chunks) {
+		exports[data.task](data.ctx, chunk);
+	}
+	postMessage(null);
+};
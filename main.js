@@ -6,20 +6,106 @@ editor.resize();
 
 window.compiler = compiler;
 
+const ctx = compiler.create_compiler_ctx();
+
 const code_size = [];
 const compile_times = [];
 
+// The compiler keeps the source and tokens of the last compile around.
+// While the editor text is known to match them, editor changes are forwarded
+// as edits so only the tokens around each change get re-lexed.
+let document_synced = false;
+
 const compile = (text) => {
-	const code_ptr = compiler.bump_alloc_src_code(text.length + 1);
+	const code_ptr = compiler.bump_alloc_src_code(ctx, text.length + 1);
 	const u8Array = new Uint8Array(compiler.memory.buffer, code_ptr, text.length + 1);
 	const text_encoder = new TextEncoder('utf-8');
 	text_encoder.encodeInto(text, u8Array);
 
+	document_synced = false;
+	const start = window.performance.now();
+	const compile_result_ptr = compiler.compile(ctx, code_ptr, u8Array.byteLength);
+	compile_times.push(window.performance.now() - start);
+	return read_compile_result(compile_result_ptr);
+};
+
+const recompile = () => {
 	const start = window.performance.now();
-	const compile_result_ptr = compiler.compile(code_ptr, u8Array.byteLength);
+	const compile_result_ptr = compiler.recompile(ctx);
 	compile_times.push(window.performance.now() - start);
+	return read_compile_result(compile_result_ptr);
+};
+
+// lexes the chunks one after another, lexer_bench.js runs them on workers
+const compile_chunked = (text, chunk_count) => {
+	const bytes = new TextEncoder('utf-8').encode(text);
+	const code_ptr = compiler.bump_alloc_src_code(ctx, bytes.length + 1);
+	new Uint8Array(compiler.memory.buffer, code_ptr, bytes.length).set(bytes);
+
+	document_synced = false;
+	chunk_count = compiler.lex_parallel_begin(ctx, code_ptr, bytes.length + 1, chunk_count);
+	for (let i = 0; i < chunk_count; ++i) {
+		compiler.lex_chunk(ctx, i);
+	}
+	compiler.lex_parallel_end(ctx);
+	return read_compile_result(compiler.recompile(ctx));
+};
+
+// compiles the function chunks one after another, lexer_bench.js runs them on workers
+const compile_functions_chunked = (text, chunk_count) => {
+	const bytes = new TextEncoder('utf-8').encode(text);
+	const code_ptr = compiler.bump_alloc_src_code(ctx, bytes.length + 1);
+	new Uint8Array(compiler.memory.buffer, code_ptr, bytes.length).set(bytes);
+
+	document_synced = false;
+	compiler.tokenize(ctx, code_ptr, bytes.length + 1);
+	chunk_count = compiler.compile_parallel_begin(ctx, chunk_count);
+	for (let i = 0; i < chunk_count; ++i) {
+		compiler.compile_chunk(ctx, i);
+	}
+	return read_compile_result(compiler.compile_parallel_end(ctx));
+};
+
+// Compiles every text in one call, packed as a u32 length and the bytes with
+// their null terminator, padded to 4 bytes. Returns the code of each module or
+// the error it threw.
+const compile_batch = (texts) => {
+	const encoded = texts.map((text) => new TextEncoder('utf-8').encode(text));
+	const packed_length = encoded.reduce((total, bytes) => total + 4 + ((bytes.length + 4) & ~3), 0);
+	const packed_ptr = compiler.bump_alloc_src_code(ctx, packed_length);
+
+	let offset = packed_ptr;
+	for (const bytes of encoded) {
+		new Uint32Array(compiler.memory.buffer, offset, 1)[0] = bytes.length + 1;
+		new Uint8Array(compiler.memory.buffer, offset + 4, bytes.length).set(bytes);
+		new Uint8Array(compiler.memory.buffer, offset + 4 + bytes.length, 1)[0] = 0;
+		offset += 4 + ((bytes.length + 4) & ~3);
+	}
+
+	document_synced = false;
+	const results_ptr = compiler.compile_batch(ctx, packed_ptr, texts.length);
+
+	const results = new Uint32Array(compiler.memory.buffer, results_ptr, texts.length * 3);
+	return texts.map((text, i) => {
+		const data = new Uint8Array(compiler.memory.buffer, results[i * 3 + 1], results[i * 3]);
+		if (results[i * 3 + 2]) return new TextDecoder('utf-8').decode(data);
+		code_size.push(data.length);
+		return data;
+	});
+};
+
+const apply_edit = (offset, removed_length, text) => {
+	const bytes = new TextEncoder('utf-8').encode(text);
+	const gap_ptr = compiler.edit_src_code(ctx, offset, removed_length, bytes.length);
+	if (!gap_ptr) return false;
+	new Uint8Array(compiler.memory.buffer, gap_ptr, bytes.length).set(bytes);
+	compiler.relex_src_code(ctx);
+	return true;
+};
+
+const read_compile_result = (compile_result_ptr) => {
 	if (!compile_result_ptr) {
-		const error_msg = new Uint8Array(compiler.memory.buffer, compiler.get_error_msg(), compiler.get_error_msg_len());
+		const error_msg = new Uint8Array(compiler.memory.buffer, compiler.get_error_msg(ctx), compiler.get_error_msg_len(ctx));
 		const text_decoder = new TextDecoder('utf-8');
 		throw text_decoder.decode(error_msg);
 	}
@@ -31,10 +117,92 @@ const compile = (text) => {
 	return code;
 };
 
+const same_code = (a, b) => a.length == b.length && a.every((byte, index) => byte == b[index]);
+
+// the opcodes in a module's function bodies, skipping immediates like instruction_length in code_gen_wasm.c
+const code_opcodes = (module) => {
+	let i = 8;
+	const skip_integer = () => {
+		while (module[i++] & 0x80);
+	};
+	const read_integer = () => {
+		let value = 0;
+		for (let shift = 0; ; shift += 7) {
+			const byte = module[i++];
+			value += (byte & 0x7f) * 2 ** shift;
+			if (!(byte & 0x80)) return value;
+		}
+	};
+
+	const opcodes = [];
+	while (i < module.length) {
+		const id = module[i++];
+		const size = read_integer();
+		if (id != 10) {
+			i += size;
+			continue;
+		}
+		for (let count = read_integer(); count > 0; --count) {
+			const body_size = read_integer();
+			const end = i + body_size;
+			for (let locals = read_integer(); locals > 0; --locals) {
+				skip_integer();
+				i += 1;
+			}
+			while (i < end) {
+				const opcode = module[i++];
+				opcodes.push(opcode);
+				switch (opcode) {
+					case 0x28: case 0x36: // i32.load, i32.store
+						skip_integer();
+						skip_integer();
+						break;
+					case 0x41: case 0x20: case 0x21: case 0x22: case 0x23: case 0x24: case 0x0c: case 0x0d: case 0x10:
+						skip_integer();
+						break;
+					case 0x02: case 0x03: case 0x04: // block, loop, if
+						i += 1;
+						break;
+				}
+			}
+		}
+		break;
+	}
+	return opcodes;
+};
+
+editor.session.on("change", (delta) => {
+	if (!document_synced) return;
+
+	const text = delta.lines.join(editor.session.doc.getNewLineCharacter());
+	// editor offsets count UTF-16 code units, they only line up with bytes for ASCII
+	if (/[^\x00-\x7F]/.test(text)) {
+		document_synced = false;
+		return;
+	}
+
+	const offset = editor.session.doc.positionToIndex(delta.start);
+	if (delta.action == "insert") {
+		document_synced = apply_edit(offset, 0, text);
+	} else {
+		document_synced = apply_edit(offset, text.length, "");
+	}
+});
+
 document.getElementById("run").onclick = async () => {
 	const editorText = editor.getValue();
 
-	const code = compile(editorText);
+	let code = null;
+	if (document_synced) {
+		code = recompile();
+	} else {
+		const is_ascii = !/[^\x00-\x7F]/.test(editorText);
+		try {
+			code = compile(editorText);
+		} finally {
+			document_synced = is_ascii;
+		}
+	}
 	console.log(code);
 	if (code == null) return;
 
@@ -49,6 +217,8 @@ document.getElementById("run").onclick = async () => {
 };
 
 const RUN_TEST_CASES = 1;
+const RUN_LEXER_BENCHMARK = 0;
+const RUN_COMPILE_BENCHMARK = 0;
 
 if (RUN_TEST_CASES) {
 	const test_cases = [
@@ -234,11 +404,28 @@ if (RUN_TEST_CASES) {
 	/* x = x + 1; */
 	return x;
 }`, 5,
+`int main() {
+	int x = 5;
+	/* x = x * 2;
+	   x = x / 2; */
+	return x;
+}`, 5,
+`int main() {
+	int a_very_long_variable_name_that_spans_several_vectors = 1234567;
+	// a comment that is long enough to need more than one vector to scan past
+	return a_very_long_variable_name_that_spans_several_vectors;
+}`, 1234567,
 		'int main() { int x = 5; int y = 17; int *z = &y; return *(z + 1); }', 5,
 		'int main() { int x = 5; int y = 17; int *z = &y; return *(&z + 2); }', 5,
 		'int main() { int x = 5; int y = 17; return *(&y + 1); }', 5,
 		'int main() { int x = 5; int y = 17; return *(&x - 1); }', 17,
 		'int main() { int x = 3; int y = 13; return *(&y-(-1)); }', 3,
+		'int second(int *p) { return *(p + 1); } int main() { int a = 3; int b = 4; return second(&b); }', 3,
+		'int main() { int a = 1; { int a = 2; a = a + 1; } return a; }', 1,
+		'int main() { int a = 1; { int b = 5; a = a + b; } { int c = 7; a = a + c; } return a; }', 13,
+		'int main() { int t = 0; for (int i = 0; i < 3; i = i + 1) t = t + i; for (int i = 0; i < 4; i = i + 1) { int j = i * 2; t = t + j; } return t; }', 15,
+		'int f(int n) { { int a = n; } { int b = n; } int c = n; if (n > 0) return f(n - 1) + c; return 0; } int main() { return f(4); }', 10,
+		`int main() {\n\tint total = 0;\n${'\ttotal = total + 1; // needs more than a page of memory to compile\n'.repeat(20000)}\treturn total;\n}`, 20000,
 `int main() {
 	int a = 128;
 	int x = 256;
@@ -439,14 +626,118 @@ int main() {
 int main() {
 	return sub(1024, 512, 256, 128, 64);
 }`, 64,
+`int sum(int n) {
+	int s = 0;
+	for (int i = 1; i <= n; i = i + 1) {
+		int square = i * i;
+		s = s + square;
+	}
+	return s;
+}
+int twice(int n) {
+	return sum(n) + sum(n);
+}
+int main() {
+	return twice(10);
+}`, 770,
+`int divide(int a, int b) {
+	return a / b;
+}
+int spin(int n) {
+	while (1) n = n + 1;
+	return n;
+}
+int main() {
+	int x = 1;
+	if (x) return divide(-9, 2);
+	return divide(1, 0) + spin(1);
+}`, -4,
+`int depth(int n) {
+	if (n == 0) return 0;
+	return 1 + depth(n - 1);
+}
+int main() {
+	return depth(10) + depth(500);
+}`, 510,
+`int main() {
+	int x = 5;
+	int total = 0;
+	for (int i = 0; i < x; i = i + 1) {
+		total = total + x * 2;
+	}
+	if (x > 3) total = total + 1;
+	else total = 0;
+	return total;
+}`, 51,
+`int main() {
+	int x = 1;
+	int y = 2;
+	int *p = &x;
+	*(p - 1) = 7;
+	return x + y;
+}`, 8,
+`int scale(int a, int b, int c) {
+	a = a + b;
+	return a * c;
+}
+int main() {
+	int x = scale(1, 2, 3);
+	return x + scale(4, 5, 6);
+}`, 63,
+`int sub(int a, int b) {
+	return a - b;
+}
+int main() {
+	int x = 1;
+	int y = sub(x = 10, x);
+	return y * 100 + sub(3, sub(2, 1)) * 10 + sub(x, 8);
+}`, 22,
+`int get(int *p) {
+	return *p;
+}
+int main() {
+	int x = 5;
+	int total = 0;
+	for (int i = 0; i < 100000; i = i + 1) total = total + get(&x);
+	return total;
+}`, 500000,
+`int count(int n) {
+	int *p = &n;
+	if (*p == 0) return 0;
+	return 1 + count(n - 1);
+}
+int main() {
+	int total = 0;
+	int *t = &total;
+	for (int i = 0; i < 2000; i = i + 1) *t = *t + count(i / 10);
+	return total;
+}`, 199000,
+`int main() {
+	int a = 1;
+	int b = 2;
+	a = b = 3;
+	return a * 10 + b;
+}`, 33,
+`int main() {
+	int x = 1;
+	if (x) {
+		for (int i = 0; i < 3; i = i + 1) x = x + i;
+	}
+	return x;
+}`, 4,
 	];
 	console.clear();
 
 	let test_case_failure = false;
+	const batch_start = window.performance.now();
+	const test_case_outputs = compile_batch(test_cases.filter((value, i) => i % 2 == 0));
+	const batch_time = window.performance.now() - batch_start;
 	for (let i = 0; i < test_cases.length; i += 2) {
 		let output = null;
 		try {
-			output = await WebAssembly.instantiate(compile(test_cases[i]));
+			const code = test_case_outputs[i / 2];
+			if (typeof code == "string") throw code;
+			output = await WebAssembly.instantiate(code);
 		} catch (e) {
 			console.log(`test case caused exception\n${test_cases[i]}`);
 			console.log(e);
@@ -467,8 +758,7 @@ int main() {
 		const len = code_size.length;
 		console.log(`Avg code size: ${Math.round(code_size.reduce((prev, current, index) => prev + current / len, 0))} bytes`);
 		console.log(`Max code size: ${code_size.reduce((prev, current, index) => Math.max(prev, current), 0)} bytes`);
-		console.log(`Avg compile time: ${Math.round(compile_times.reduce((prev, current, index) => prev + current / len, 0))}ms`);
-		console.log(`Max compile time: ${Math.round(compile_times.reduce((prev, current, index) => Math.max(prev, current), 0))}ms`);
+		console.log(`Compile time of all ${test_cases.length / 2} test cases: ${Math.round(batch_time)}ms`);
 	}
 
 	const error_test_cases = [
@@ -481,6 +771,9 @@ int main() {
 		'int main() { int = 5 }',
 		'int main() { x = 5 }',
 		'int main() { int ab = 10; a; }',
+		'int main() { int a = 1; { int b = 2; } int a = 3; }',
+		'int f(int a) { int a = 1; return a; } int main() { return f(2); }',
+		'int main() { { int b = 2; } return b; }',
 		'int main() { 5;',
 		'int main() {{{ 0; }}',
 		'int main() { int x = 27; { x = x + 1; { 2; } return x; }',
@@ -520,9 +813,11 @@ int main() {
 	];
 
 	test_case_failure = false;
+	const error_test_case_outputs = compile_batch(error_test_cases);
 	for (let i = 0; i < error_test_cases.length && !test_case_failure; ++i) {
 		try {
-			const output = compile(error_test_cases[i]);
+			const output = error_test_case_outputs[i];
+			if (typeof output == "string") throw output;
 			test_case_failure = true;
 			console.log(`error test case failed\n${error_test_cases[i]}`);
 			test_case_failure = true;
@@ -538,4 +833,228 @@ int main() {
 		console.log("All error test cases passed!");
 	}
 
+	// source, edits as [offset, removed length, inserted text], value main() returns afterwards
+	const edit_test_cases = [
+		'int main() { return 1; }', [[20, 1, '20 + 22']], 42,
+		'int main() { int ab = 5; return a; }', [[33, 0, 'b']], 5,
+		'int main() { return 5; return 7; }', [[13, 0, '/* '], [25, 0, ' */']], 7,
+		'int main() { /* return 5; */ return 7; }', [[13, 3, ''], [22, 3, '']], 5,
+		'int main() {\n\t// return 5;\n\treturn 7;\n}', [[14, 3, '']], 5,
+		'int main() { return 1; }', [[0, 0, 'int one() { return 1; }\nint two() { return one() + one(); }\n'], [80, 1, 'two()']], 2,
+		'int main() { return 1; }', [[0, 24, ''], [0, 0, 'int main() { return 3 * 3; }']], 9,
+		'int f() { return 1; }\nint main() { return f() + 10; }', [[17, 1, '5']], 15,
+		'int a() { return 1; }\nint b() { return 2; }\nint main() { return b(); }', [[0, 22, '']], 2,
+	];
+
+	test_case_failure = false;
+	for (let i = 0; i < edit_test_cases.length; i += 3) {
+		let text = edit_test_cases[i];
+		let output = null;
+		try {
+			compile(text);
+			for (const [offset, removed_length, inserted] of edit_test_cases[i + 1]) {
+				apply_edit(offset, removed_length, inserted);
+				text = text.slice(0, offset) + inserted + text.slice(offset + removed_length);
+			}
+			output = await WebAssembly.instantiate(recompile());
+		} catch (e) {
+			console.log(`edit test case caused exception\n${text}`);
+			console.log(e);
+			test_case_failure = true;
+			continue;
+		}
+		const result = output.instance.exports.main();
+		if (result != edit_test_cases[i + 2]) {
+			console.log(`edit test case failed\n${text}\nshould return: ${edit_test_cases[i + 2]}\nresult: ${result}`);
+			test_case_failure = true;
+		}
+	}
+	if (!test_case_failure) {
+		console.log("All edit test cases passed!");
+	}
+
+	test_case_failure = false;
+	for (let i = 0; i < test_cases.length; i += 2) {
+		const expected_code = compile(test_cases[i]).slice();
+		const code = compile_chunked(test_cases[i], 3);
+		if (!same_code(code, expected_code)) {
+			console.log(`chunked lexing doesn't match a full compile\n${test_cases[i]}`);
+			test_case_failure = true;
+		}
+	}
+	if (!test_case_failure) {
+		console.log("All chunked lexing test cases passed!");
+	}
+
+	test_case_failure = false;
+	for (let i = 0; i < test_cases.length; i += 2) {
+		const expected_code = compile(test_cases[i]).slice();
+		const code = compile_functions_chunked(test_cases[i], 2);
+		if (!same_code(code, expected_code)) {
+			console.log(`compiling the functions in chunks doesn't match a full compile\n${test_cases[i]}`);
+			test_case_failure = true;
+		}
+	}
+	for (let i = 0; i < error_test_cases.length; ++i) {
+		let expected_error = null;
+		let error = null;
+		try {
+			compile(error_test_cases[i]);
+		} catch (e) {
+			expected_error = e;
+		}
+		try {
+			compile_functions_chunked(error_test_cases[i], 2);
+		} catch (e) {
+			error = e;
+		}
+		if (error != expected_error) {
+			console.log(`compiling the functions in chunks reports a different error\n${error_test_cases[i]}\nshould be: ${expected_error}\nresult: ${error}`);
+			test_case_failure = true;
+		}
+	}
+	if (!test_case_failure) {
+		console.log("All chunked function test cases passed!");
+	}
+
+	// get_arena_stats returns { used, peak, capacity } for the source, front-end, ast, output and previous output arenas
+	const ast_peak = (function_count) => {
+		let text = '';
+		for (let i = 0; i < function_count; ++i) {
+			text += `int f${i}(int a) { int t = 0; for (int j = 0; j < a; j = j + 1) { t = t + j * 2; } return t; }\n`;
+		}
+		compile(text + 'int main() { return f0(3); }');
+		return new Uint32Array(compiler.memory.buffer, compiler.get_arena_stats(ctx), 12)[7];
+	};
+	if (ast_peak(1) != ast_peak(10)) {
+		console.log("the ast arena isn't released after each function");
+	} else {
+		console.log("Arena stats test passed!");
+	}
+
+	// two contexts compiled in turns must not see each other's source, tokens or cache
+	const compile_in = (context, text) => {
+		const bytes = new TextEncoder('utf-8').encode(text);
+		const ptr = compiler.bump_alloc_src_code(context, bytes.length + 1);
+		new Uint8Array(compiler.memory.buffer, ptr, bytes.length).set(bytes);
+		return compiler.compile(context, ptr, bytes.length + 1);
+	};
+	const run_result = async (compile_result_ptr) => {
+		const compile_result = new Uint32Array(compiler.memory.buffer, compile_result_ptr, 2);
+		const code = new Uint8Array(compiler.memory.buffer, compile_result[1], compile_result[0]).slice();
+		return (await WebAssembly.instantiate(code)).instance.exports.main();
+	};
+	const other_ctx = compiler.create_compiler_ctx();
+	const first = compile_in(ctx, 'int f(int a) { return a * 2; } int main() { return f(21); }');
+	const second = compile_in(other_ctx, 'int g(int b, int c) { return b - c; } int main() { int x = 3; return g(x, 10); }');
+	if (await run_result(first) != 42 || await run_result(second) != -7 || await run_result(compiler.recompile(ctx)) != 42) {
+		console.log("compiles in separate contexts interfere with each other");
+	} else {
+		console.log("Compiler context test passed!");
+	}
+
+	// a call to a pure function with constant arguments compiles to its result
+	const fib = 'int fib(int n) { if (n <= 1) return n; return fib(n - 1) + fib(n - 2); }\n';
+	const folded = compile(fib + 'int main() { return fib(9); }').slice();
+	const constant = compile(fib + 'int main() { return 34; }');
+	if (!same_code(folded, constant)) {
+		console.log("calls to pure functions with constant arguments aren't evaluated at compile time");
+	} else {
+		console.log("Compile time evaluation test passed!");
+	}
+
+	// locals that are known to be constant are folded into the code that reads them
+	const propagated = compile('int main() { int x = 5; return x * 4 + 1; }').slice();
+	const literal = compile('int main() { int x = 5; return 21; }');
+	if (!same_code(propagated, literal)) {
+		console.log("constants aren't propagated through locals");
+	} else {
+		console.log("Constant propagation test passed!");
+	}
+
+	// variables of a function that takes no addresses never touch memory
+	const loop = compile('int main() { int total = 0; for (int i = 0; i < 10; i = i + 1) total = total + i; return total; }');
+	const I32_LOAD = 0x28, I32_STORE = 0x36;
+	const loop_opcodes = code_opcodes(loop);
+	if (loop_opcodes.includes(I32_LOAD) || loop_opcodes.includes(I32_STORE)) {
+		console.log("variables that don't have their address taken are kept in memory");
+	} else {
+		console.log("Wasm locals test passed!");
+	}
+
+	// exporting only main drops the functions it never calls and renumbers the rest,
+	// twice reads through a pointer so its calls aren't evaluated at compile time
+	compiler.set_export_main_only(ctx, true);
+	const CALL = 0x10;
+	const twice = 'int twice(int *a) { return *a * 2; }\n';
+	const used_main = 'int main() { int x = 4; return twice(&x); }';
+	const pruned = compile('int unused(int a) { return a; }\n' + twice + 'int also_unused() { int y = 3; return twice(&y); }\n' + used_main).slice();
+	const used_only = compile(twice + used_main);
+	compiler.set_export_main_only(ctx, false);
+	const reachable = await WebAssembly.instantiate(pruned);
+	if (!same_code(pruned, used_only) || !code_opcodes(pruned).includes(CALL) || reachable.instance.exports.main() != 8) {
+		console.log("exporting only main keeps functions main doesn't reach");
+	} else {
+		console.log("Dead function elimination test passed!");
+	}
+
+	// sizes and counts past what a single byte holds, and a header bigger than the room left for it
+	let many_functions = '';
+	for (let i = 0; i < 300; ++i) many_functions += `int function_number_${i}(int a, int b) { return a + b + ${i}; }\n`;
+	// arguments read through a pointer keep the calls, whose indices take two bytes
+	many_functions += 'int main() { int x = 1; int *p = &x; return function_number_299(*p, 2) + function_number_130(*p - 1, 0); }';
+	const large_code = compile(many_functions).slice();
+	const large = await WebAssembly.instantiate(large_code);
+	if (code_opcodes(large_code).filter((opcode) => opcode == CALL).length != 2 || large.instance.exports.main() != 432) {
+		console.log("modules with many functions are malformed");
+	} else {
+		console.log("Large module test passed!");
+	}
+
+	// the peephole pass counts every rewrite it makes, by rule
+	const rewritten = await WebAssembly.instantiate(compile('int main() { int total = 0; for (int i = 0; i < 10; i = i + 1) total = total + i; return total; }'));
+	const rule_count = compiler.get_peephole_rule_count();
+	const rule_hits = new Uint32Array(compiler.memory.buffer, compiler.get_peephole_hits(ctx), rule_count);
+	const hits = {};
+	for (let rule = 0; rule < rule_count; ++rule) {
+		const name_ptr = compiler.get_peephole_rule_name(rule);
+		const bytes = new Uint8Array(compiler.memory.buffer, name_ptr);
+		hits[new TextDecoder('utf-8').decode(bytes.subarray(0, bytes.indexOf(0)))] = rule_hits[rule];
+	}
+	if (!hits.tee_drop || !hits.invert_comparison || rewritten.instance.exports.main() != 45) {
+		console.log("the peephole pass doesn't rewrite assignments and loop conditions");
+	} else {
+		console.log("Peephole test passed!");
+	}
+
+	compiler.set_direct_emit(ctx, true);
+	test_case_failure = false;
+	for (let i = 0; i < test_cases.length; i += 2) {
+		let result = null;
+		try {
+			const output = await WebAssembly.instantiate(compile(test_cases[i]));
+			result = output.instance.exports.main();
+		} catch (e) {
+			console.log(e);
+		}
+		if (result != test_cases[i + 1]) {
+			console.log(`direct emit test case failed\n${test_cases[i]}\nshould return: ${test_cases[i + 1]}\nresult: ${result}`);
+			test_case_failure = true;
+		}
+	}
+	compiler.set_direct_emit(ctx, false);
+	if (!test_case_failure) {
+		console.log("All direct emit test cases passed!");
+	}
+
+}
+
+if (RUN_LEXER_BENCHMARK) {
+	const { default: run_lexer_benchmark } = await import("./lexer_bench.js");
+	await run_lexer_benchmark();
+}
+
+if (RUN_COMPILE_BENCHMARK) {
+	const { default: run_compile_benchmark } = await import("./compile_bench.js");
+	run_compile_benchmark();
 }
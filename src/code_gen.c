@@ -1,306 +1,776 @@
-#include "code_gen.h"
+#include "compiler.h"
 #include "code_gen_wasm.h"
 
-static u8 *c;
-static bool error_occurred;
+// more than any single node writes between two calls to gen_expr
+#define MAX_NODE_OUTPUT 64
+// room left in front of the first body when there's no last module to go by
+#define HEADER_GAP 1024
+
+// The function bodies are written to a reservation at the top of the output
+// arena, which moves when it has to grow, so positions in it are kept as
+// offsets from code_start.
+static void reserve_code(compiler_ctx *ctx, u32 size) {
+	if (ctx->gen.c + size <= ctx->gen.code_limit) return;
+
+	u32 length = ctx->gen.c - ctx->gen.code_start;
+	u32 capacity = (length + size) * 2;
+	ctx->gen.code_start = bump_reserve(ctx, ARENA_OUTPUT, capacity);
+	ctx->gen.code_limit = ctx->gen.code_start + capacity;
+	ctx->gen.c = ctx->gen.code_start + length;
+}
+
+void gen_expr(compiler_ctx *ctx, u32 index);
+void gen_code_block(compiler_ctx *ctx, u32 index) {
+	while (ctx->gen.nodes[index].next) {
+		gen_expr(ctx, index);
+		ctx->gen.c += drop(ctx->gen.c);
+		index = ctx->gen.nodes[index].next;
+	}
+	gen_expr(ctx, index);
+}
 
-void gen_expr(node *n);
-void gen_code_block(node *n) {
-	node *current_expr = n;
-	while (current_expr->next) {
-		gen_expr(current_expr);
-		c += drop(c);
-		current_expr = current_expr->next;
+// Every module keeps where each function's code is in it, by the function's
+// hash, so a recompile can copy the functions that didn't change out of the
+// previous module instead of compiling them again.
+typedef struct cached_function cached_function;
+struct cached_function {
+	u64 hash;
+	u32 offset;
+	u32 length;
+};
+
+typedef struct function_cache function_cache;
+struct function_cache {
+	u8 *code;
+	cached_function *functions;
+	u32 *slots; // open addressing by hash, holds the index into functions + 1
+	u32 mask;
+	u32 header_length; // of the module, the next one likely needs as much in front of its bodies
+};
+
+static void add_compiled(compiler_ctx *ctx, u64 hash, u32 offset, u32 length) {
+	if (ctx->gen.compiled_count == ctx->gen.compiled_capacity) {
+		ctx->gen.compiled_capacity *= 2;
+		cached_function *new_compiled = bump_alloc(ctx, ARENA_FRONT_END, sizeof(cached_function) * ctx->gen.compiled_capacity);
+		__builtin_memcpy(new_compiled, ctx->gen.compiled, sizeof(cached_function) * ctx->gen.compiled_count);
+		ctx->gen.compiled = new_compiled;
 	}
-	gen_expr(current_expr);
+
+	ctx->gen.compiled[ctx->gen.compiled_count++] = (cached_function){ hash, offset, length };
+}
+
+// The cache lives next to the last module, which is gone once a new source
+// was loaded. The bodies start behind a gap that gen_end puts the sections
+// in front of them into, if they fit.
+void gen_begin(compiler_ctx *ctx) {
+	if (bump_empty(ctx, ARENA_PREVIOUS_OUTPUT)) ctx->gen.cache = 0;
+
+	ctx->gen.compiled_capacity = 16;
+	ctx->gen.compiled = bump_alloc(ctx, ARENA_FRONT_END, sizeof(cached_function) * ctx->gen.compiled_capacity);
+	ctx->gen.compiled_count = 0;
+	__builtin_memset(ctx->gen.peephole_hits, 0, sizeof(ctx->gen.peephole_hits));
+
+	ctx->gen.header_gap = (ctx->gen.cache) ? ctx->gen.cache->header_length : HEADER_GAP;
+	ctx->gen.code_start = ctx->gen.c = bump_reserve(ctx, ARENA_OUTPUT, PAGE_SIZE);
+	ctx->gen.code_limit = ctx->gen.code_start + PAGE_SIZE;
+	reserve_code(ctx, ctx->gen.header_gap);
+	ctx->gen.c += ctx->gen.header_gap;
+	ctx->gen.error_occurred = false;
+}
+
+void gen_clear_cache(compiler_ctx *ctx) {
+	ctx->gen.cache = 0;
+}
+
+bool gen_cached(compiler_ctx *ctx, func *f) {
+	if (!ctx->gen.cache || !f->hash) return false;
+
+	for (u32 slot = f->hash & ctx->gen.cache->mask; ctx->gen.cache->slots[slot]; slot = (slot + 1) & ctx->gen.cache->mask) {
+		cached_function *cached = ctx->gen.cache->functions + ctx->gen.cache->slots[slot] - 1;
+		if (cached->hash != f->hash) continue;
+
+		reserve_code(ctx, cached->length + MAX_NODE_OUTPUT);
+		add_compiled(ctx, f->hash, ctx->gen.c - ctx->gen.code_start, cached->length);
+		__builtin_memcpy(ctx->gen.c, ctx->gen.cache->code + cached->offset, cached->length);
+		ctx->gen.c += cached->length;
+		return true;
+	}
+	return false;
+}
+
+void gen_append(compiler_ctx *ctx, compiler_ctx *from) {
+	u8 *bodies = from->gen.code_start + from->gen.header_gap;
+	u32 length = from->gen.c - bodies;
+	reserve_code(ctx, length + MAX_NODE_OUTPUT);
+
+	u32 offset = ctx->gen.c - ctx->gen.code_start - from->gen.header_gap;
+	__builtin_memcpy(ctx->gen.c, bodies, length);
+	ctx->gen.c += length;
+
+	for (u32 i = 0; i < from->gen.compiled_count; ++i) {
+		cached_function *function = from->gen.compiled + i;
+		add_compiled(ctx, function->hash, offset + function->offset, function->length);
+	}
+	for (u32 rule = 0; rule < PEEPHOLE_RULE_COUNT; ++rule) {
+		ctx->gen.peephole_hits[rule] += from->gen.peephole_hits[rule];
+	}
+}
+
+// The bytes a function with its variables in a frame takes off the stack,
+// its locals and then its parameters above them.
+static u32 frame_bytes(compiler_ctx *ctx) {
+	return ctx->gen.frame_size + 4 * ctx->gen.arg_count;
 }
 
-compile_result *gen_code(func *ast, u32 function_count) {
+// A variable the parser put at addr is frame_size - addr above the bottom
+// of the frame, so the layout in memory is the same whichever way the
+// function addresses it.
+static u32 frame_offset(compiler_ctx *ctx, u32 addr) {
+	return ctx->gen.frame_size - (i32)addr;
+}
 
-	u8 *code = bump_alloc(0);
-	c = code;
-	error_occurred = false;
+// Arguments are wasm parameters. A function whose variables are in memory
+// has one more local, the frame pointer, and spills its parameters so they
+// end up where the callers of the stack layout store them. Direct emit
+// doesn't know the frame's size before the body is parsed, so its frame
+// pointer is the top of the frame and callers move the stack pointer past
+// what's in use. Otherwise the frame pointer is the bottom of the frame,
+// reserved on entry and released on the way out, and calls leave the stack
+// pointer alone.
+static void function_begin(compiler_ctx *ctx, func *f) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.function_start = ctx->gen.c - ctx->gen.code_start;
+	ctx->gen.function_hash = f->hash;
+	ctx->gen.arg_count = f->arg_count;
+	ctx->gen.c += PADDED_INTEGER_LENGTH; // the body's size
+	ctx->gen.frame_size = f->locals.frame_size;
+	if (ctx->gen.storage == VARIABLES_IN_LOCALS) {
+		u32 local_count = f->locals.frame_size / 4;
+		*ctx->gen.c++ = local_count > 0; // vec(locals)
+		if (local_count) {
+			ctx->gen.c += encode_integer(ctx->gen.c, local_count);
+			*ctx->gen.c++ = VALTYPE_I32;
+		}
+		ctx->gen.instructions_start = ctx->gen.c - ctx->gen.code_start;
+		return;
+	}
 
-	c += create_module(c);
+	*ctx->gen.c++ = 1; // vec(locals)
+	*ctx->gen.c++ = 1;
+	*ctx->gen.c++ = VALTYPE_I32;
+	ctx->gen.instructions_start = ctx->gen.c - ctx->gen.code_start;
+
+	u32 spill_offset = 0;
+	*ctx->gen.c++ = GLOBAL_GET;
+	*ctx->gen.c++ = 0;
+	if (ctx->gen.storage == VARIABLES_IN_FRAME) {
+		if (frame_bytes(ctx)) {
+			ctx->gen.c += i32_const(ctx->gen.c, frame_bytes(ctx));
+			ctx->gen.c += i32_sub(ctx->gen.c);
+			ctx->gen.c += local_tee(ctx->gen.c, f->arg_count);
+			*ctx->gen.c++ = GLOBAL_SET;
+			*ctx->gen.c++ = 0;
+		} else {
+			ctx->gen.c += local_set(ctx->gen.c, f->arg_count);
+		}
+		spill_offset = ctx->gen.frame_size;
+	} else {
+		if (f->arg_count) {
+			ctx->gen.c += i32_const(ctx->gen.c, 4 * f->arg_count);
+			ctx->gen.c += i32_sub(ctx->gen.c);
+		}
+		ctx->gen.c += local_set(ctx->gen.c, f->arg_count);
+	}
 
-	c += create_wasm_layout(c, ast, function_count);
+	for (u32 i = 0; i < f->arg_count; ++i) {
+		reserve_code(ctx, MAX_NODE_OUTPUT);
+		ctx->gen.c += local_get(ctx->gen.c, f->arg_count);
+		ctx->gen.c += local_get(ctx->gen.c, i);
+		ctx->gen.c += i32_store(ctx->gen.c, 2, spill_offset + 4 * (i + 1));
+	}
+}
 
-	func *function_stack[function_count];
-	function_stack[0] = ast;
-	u32 function_stack_length = 1;
+// gives the frame back before a function with its variables in a frame returns
+static void release_frame(compiler_ctx *ctx) {
+	if (ctx->gen.storage != VARIABLES_IN_FRAME || !frame_bytes(ctx)) return;
+	ctx->gen.c += local_get(ctx->gen.c, ctx->gen.arg_count);
+	ctx->gen.c += i32_const(ctx->gen.c, frame_bytes(ctx));
+	ctx->gen.c += i32_add(ctx->gen.c);
+	*ctx->gen.c++ = GLOBAL_SET;
+	*ctx->gen.c++ = 0;
+}
 
-	*c++ = SECTION_CODE;
-	u8 *code_section_start = c;
+static void function_end(compiler_ctx *ctx) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	release_frame(ctx);
+	ctx->gen.c += end_code_block(ctx->gen.c);
+	ctx->gen.c = peephole(ctx->gen.code_start + ctx->gen.instructions_start, ctx->gen.c, ctx->gen.peephole_hits);
+	u32 length = ctx->gen.c - ctx->gen.code_start - ctx->gen.function_start;
+	encode_padded_integer(ctx->gen.code_start + ctx->gen.function_start, length - PADDED_INTEGER_LENGTH);
+	add_compiled(ctx, ctx->gen.function_hash, ctx->gen.function_start, length);
+}
+
+// A function that never takes an address or dereferences one can't tell
+// where its variables are, so they're wasm locals instead of stack slots. Any
+// & or * keeps the whole frame in memory, since pointer arithmetic reaches
+// the variables next to the one whose address was taken.
+void gen_function(compiler_ctx *ctx, func *f) {
+	ctx->gen.storage = (f->uses_addresses) ? VARIABLES_IN_FRAME : VARIABLES_IN_LOCALS;
+	function_begin(ctx, f);
+	ctx->gen.nodes = f->nodes;
+	gen_code_block(ctx, f->body);
+	function_end(ctx);
+	ctx->gen.storage = VARIABLES_ON_STACK;
+}
+
+// skips a body's size and its locals
+static u8 *first_instruction(u8 *body) {
+	u8 length;
+	decode_integer(body, &length);
+	body += length;
+
+	u32 local_groups = decode_integer(body, &length);
+	body += length;
+	for (u32 group = 0; group < local_groups; ++group) {
+		decode_integer(body, &length);
+		body += length + 1;
+	}
+	return body;
+}
 
-	u32 total_size = 0;
-	*c++ = function_count;
+// Functions only call the ones declared before them, so one pass from the
+// last function back finds everything main reaches.
+static u32 find_reachable(compiler_ctx *ctx, func *functions, u32 function_count, bool *reachable) {
 	for (u32 i = 0; i < function_count; ++i) {
-		func *f = function_stack[--function_stack_length];
-		if (f->right) function_stack[function_stack_length++] = f->right;
-		if (f->left) function_stack[function_stack_length++] = f->left;
-
-		u8 *func_start = c;
-		*c++ = 1; // vec(locals)
-		*c++ = 1;
-		*c++ = VALTYPE_I32;
-
-		*c++ = GLOBAL_GET;
-		*c++ = 0;
-		*c++ = LOCAL_SET;
-		*c++ = 0;
-
-		gen_code_block(f->body);
-		c += end_code_block(c);
-		u32 length = c - func_start;
-		u32 encoded_integer_length = encode_integer_length(length);
-		__builtin_memcpy(func_start + encoded_integer_length, func_start, length);
-		c += encode_integer(func_start, length);
+		reachable[i] = !ctx->export_main_only || functions[i].symbol == SYMBOL_MAIN;
+	}
+	if (!ctx->export_main_only) return function_count;
+
+	u32 reachable_count = 0;
+	for (u32 i = function_count; i-- > 0;) {
+		if (!reachable[i]) continue;
+		reachable_count += 1;
+
+		cached_function *function = ctx->gen.compiled + i;
+		u8 *body = ctx->gen.code_start + function->offset;
+		u8 length;
+		for (u8 *c = first_instruction(body); c < body + function->length; c += instruction_length(c)) {
+			if (*c == CALL) reachable[decode_integer(c + 1, &length)] = true;
+		}
+	}
+	return reachable_count;
+}
+
+// copies a function's code with every call pointing at the callee's index in the new module
+static u32 copy_renumbered(u8 *to, u8 *from, u32 from_length, u32 *new_index) {
+	u8 size_length;
+	decode_integer(from, &size_length);
+	u8 *instructions = first_instruction(from);
+	u8 *c = to + PADDED_INTEGER_LENGTH;
+	__builtin_memcpy(c, from + size_length, instructions - from - size_length);
+	c += instructions - from - size_length;
+
+	u8 length;
+	for (u8 *i = instructions; i < from + from_length; i += instruction_length(i)) {
+		if (*i == CALL) {
+			c += call(c, new_index[decode_integer(i + 1, &length)]);
+		} else {
+			__builtin_memcpy(c, i, instruction_length(i));
+			c += instruction_length(i);
+		}
 	}
-	total_size = c - code_section_start;
 
-	u32 encoded_integer_length = encode_integer_length(total_size);
-	__builtin_memcpy(code_section_start + encoded_integer_length, code_section_start, total_size);
-	c += encode_integer(code_section_start, total_size);
+	encode_padded_integer(to, c - to - PADDED_INTEGER_LENGTH);
+	return c - to;
+}
 
-	c += end_module(c);
+// The sections in front of the code need every function, so they're built
+// once the last body is written and go into the gap gen_begin left in front
+// of the bodies. Only a header that outgrew the gap moves the bodies.
+// Exporting only main drops the functions main doesn't reach. The module
+// then gets a copy of the bodies with the calls renumbered, written behind the
+// header, and the cache keeps the bodies as they were, since the next compile
+// numbers functions the same way this one did.
+compile_result *gen_end(compiler_ctx *ctx, func *functions, u32 function_count) {
+	u32 bodies_length = ctx->gen.c - ctx->gen.code_start - ctx->gen.header_gap;
+
+	bool *reachable = bump_alloc(ctx, ARENA_AST, sizeof(bool) * function_count);
+	u32 kept_count = find_reachable(ctx, functions, function_count, reachable);
+
+	func **kept = bump_alloc(ctx, ARENA_AST, sizeof(func *) * function_count);
+	u32 *new_index = bump_alloc(ctx, ARENA_AST, sizeof(u32) * function_count);
+	u32 header_size = MAX_NODE_OUTPUT * 2;
+	for (u32 i = 0, k = 0; i < function_count; ++i) {
+		if (!reachable[i]) continue;
+		new_index[i] = k;
+		kept[k++] = functions + i;
+		header_size += symbol_name(ctx, functions[i].symbol).length + functions[i].arg_count + 24;
+	}
+
+	u8 *header = bump_alloc(ctx, ARENA_AST, header_size);
+	u8 *h = header;
+	h += create_module(h);
+	h += create_wasm_layout(ctx, h, kept, kept_count, ctx->export_main_only);
+	*h++ = SECTION_CODE;
+	u8 *code_size = h;
+	h += PADDED_INTEGER_LENGTH;
+	h += encode_integer(h, kept_count);
+	u32 header_length = h - header;
+	u32 count_length = h - code_size - PADDED_INTEGER_LENGTH;
+
+	u8 *module = 0;
+	u32 module_length = 0;
+	u32 moved = 0;
+	if (kept_count < function_count) {
+		bump_commit(ctx, ARENA_OUTPUT, ctx->gen.c - ctx->gen.code_start);
+
+		module = bump_alloc(ctx, ARENA_OUTPUT, header_length + bodies_length + MAX_NODE_OUTPUT);
+		u8 *c = module + header_length;
+		for (u32 i = 0; i < function_count; ++i) {
+			if (!reachable[i]) continue;
+			cached_function *function = ctx->gen.compiled + i;
+			c += copy_renumbered(c, ctx->gen.code_start + function->offset, function->length, new_index);
+		}
+		encode_padded_integer(code_size, count_length + (c - module - header_length));
+		__builtin_memcpy(module, header, header_length);
+
+		module_length = c - module;
+		module_length += end_module(module + module_length);
+	} else {
+		encode_padded_integer(code_size, count_length + bodies_length);
+		if (header_length > ctx->gen.header_gap) {
+			moved = header_length - ctx->gen.header_gap;
+			reserve_code(ctx, moved + MAX_NODE_OUTPUT);
+			u8 *bodies = ctx->gen.code_start + ctx->gen.header_gap;
+			__builtin_memmove(bodies + moved, bodies, bodies_length);
+			ctx->gen.c += moved;
+			ctx->gen.header_gap = header_length;
+		}
+
+		module = ctx->gen.code_start + ctx->gen.header_gap - header_length;
+		__builtin_memcpy(module, header, header_length);
+		ctx->gen.c += end_module(ctx->gen.c);
+
+		module_length = ctx->gen.c - module;
+		bump_commit(ctx, ARENA_OUTPUT, ctx->gen.c - ctx->gen.code_start);
+	}
+
+	compile_result *result = bump_alloc(ctx, ARENA_OUTPUT, sizeof(compile_result));
+	result->code = module;
+	result->length = module_length;
+
+	u32 slot_count = 16;
+	while (slot_count < ctx->gen.compiled_count * 2) slot_count *= 2;
+
+	ctx->gen.cache = bump_alloc(ctx, ARENA_OUTPUT, sizeof(function_cache));
+	ctx->gen.cache->code = ctx->gen.code_start;
+	ctx->gen.cache->header_length = header_length;
+	ctx->gen.cache->functions = bump_alloc(ctx, ARENA_OUTPUT, sizeof(cached_function) * ctx->gen.compiled_count);
+	ctx->gen.cache->slots = bump_alloc(ctx, ARENA_OUTPUT, sizeof(u32) * slot_count);
+	ctx->gen.cache->mask = slot_count - 1;
+	__builtin_memset(ctx->gen.cache->slots, 0, sizeof(u32) * slot_count);
+
+	for (u32 i = 0; i < ctx->gen.compiled_count; ++i) {
+		cached_function *function = ctx->gen.cache->functions + i;
+		*function = ctx->gen.compiled[i];
+		function->offset += moved;
+		if (!function->hash) continue;
+
+		u32 slot = function->hash & ctx->gen.cache->mask;
+		while (ctx->gen.cache->slots[slot]) slot = (slot + 1) & ctx->gen.cache->mask;
+		ctx->gen.cache->slots[slot] = i + 1;
+	}
 
-	bump_alloc(c - code);
-	compile_result *result = bump_alloc(sizeof(compile_result));
-	result->code = code;
-	result->length = c - code;
 	return result;
 }
 
-void gen_addr(node *n) {
-	if (n->type == NODE_VAR) {
-		*c++ = LOCAL_GET;
-		*c++ = 0;
+static void gen_var_addr(compiler_ctx *ctx, u32 addr) {
+	ctx->gen.c += local_get(ctx->gen.c, ctx->gen.arg_count);
 
-		if (n->var.addr > 0) {
-			c += i32_const(c, n->var.addr);
-			c += i32_sub(c);
-		}
+	if (addr > 0) {
+		ctx->gen.c += i32_const(ctx->gen.c, addr);
+		ctx->gen.c += i32_sub(ctx->gen.c);
+	}
+}
+
+static u32 variable_local(compiler_ctx *ctx, u32 addr) {
+	if ((i32)addr < 0) return -(i32)addr / 4 - 1;
+	return ctx->gen.arg_count + addr / 4;
+}
+
+// A function with its variables on the stack keeps its parameters and the
+// locals in scope below the stack pointer while it calls.
+static u32 call_frame_size(compiler_ctx *ctx, u32 stack_pointer) {
+	if (ctx->gen.storage != VARIABLES_ON_STACK) return 0;
+	return stack_pointer + 4 * ctx->gen.arg_count;
+}
+
+static void move_stack_pointer(compiler_ctx *ctx, u32 distance, bool down) {
+	if (!distance) return;
+	*ctx->gen.c++ = GLOBAL_GET;
+	*ctx->gen.c++ = 0;
+	ctx->gen.c += i32_const(ctx->gen.c, distance);
+	ctx->gen.c += (down) ? i32_sub(ctx->gen.c) : i32_add(ctx->gen.c);
+	*ctx->gen.c++ = GLOBAL_SET;
+	*ctx->gen.c++ = 0;
+}
+
+static void gen_binary(compiler_ctx *ctx, node_type type) {
+	switch (type) {
+		case NODE_PLUS: {
+			ctx->gen.c += i32_add(ctx->gen.c);
+		} break;
+		case NODE_MINUS: {
+			ctx->gen.c += i32_sub(ctx->gen.c);
+		} break;
+		case NODE_MULTIPLY: {
+			ctx->gen.c += i32_mul(ctx->gen.c);
+		} break;
+		case NODE_DIVIDE: {
+			ctx->gen.c += i32_div_s(ctx->gen.c);
+		} break;
+		case NODE_EQ: {
+			ctx->gen.c += i32_eq(ctx->gen.c);
+		} break;
+		case NODE_NE: {
+			ctx->gen.c += i32_ne(ctx->gen.c);
+		} break;
+		case NODE_GT: {
+			ctx->gen.c += i32_gt_s(ctx->gen.c);
+		} break;
+		case NODE_LT: {
+			ctx->gen.c += i32_lt_s(ctx->gen.c);
+		} break;
+		case NODE_GE: {
+			ctx->gen.c += i32_ge_s(ctx->gen.c);
+		} break;
+		case NODE_LE: {
+			ctx->gen.c += i32_le_s(ctx->gen.c);
+		} break;
+	}
+}
+
+void gen_addr(compiler_ctx *ctx, node *n) {
+	if (n->type == NODE_VAR) {
+		ctx->gen.c += local_get(ctx->gen.c, ctx->gen.arg_count);
+		ctx->gen.c += i32_const(ctx->gen.c, frame_offset(ctx, n->var.addr));
+		ctx->gen.c += i32_add(ctx->gen.c);
 		return;
 	}
 	if (n->type == NODE_DEREF) {
-		gen_expr(n->right);
+		gen_expr(ctx, n->right);
 		return;
 	}
 
-	error_occurred = true;
+	ctx->gen.error_occurred = true;
 }
 
-void gen_expr(node *n) {
-	if (error_occurred) return;
+void gen_node(compiler_ctx *ctx, node *n);
+void gen_expr(compiler_ctx *ctx, u32 index) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	gen_node(ctx, ctx->gen.nodes + index);
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+}
+
+void gen_node(compiler_ctx *ctx, node *n) {
+	if (ctx->gen.error_occurred) return;
+
+	node_extra *extra = extra_of(n);
 
 	if (n->type == NODE_INT) {
-		c += i32_const(c, n->value);
+		ctx->gen.c += i32_const(ctx->gen.c, n->value);
 		return;
 	}
 
 	if (n->type == NODE_VAR) {
-		gen_addr(n);
-		c += i32_load(c, 2, 0);
+		if (ctx->gen.storage == VARIABLES_IN_LOCALS) {
+			ctx->gen.c += local_get(ctx->gen.c, variable_local(ctx, n->var.addr));
+			return;
+		}
+		ctx->gen.c += local_get(ctx->gen.c, ctx->gen.arg_count);
+		ctx->gen.c += i32_load(ctx->gen.c, 2, frame_offset(ctx, n->var.addr));
 		return;
 	}
 
 	if (n->type == NODE_FUNC_CALL) {
+		u32 frame_size = call_frame_size(ctx, extra->func_call.stack_pointer);
+		move_stack_pointer(ctx, frame_size, true);
 
-		u32 arg_count = 0;
-		node *current = n->func_call.args;
-
-		if (n->func_call.stack_pointer > 0) {
-			*c++ = GLOBAL_GET;
-			*c++ = 0;
-			c += i32_const(c, n->func_call.stack_pointer);
-			c += i32_sub(c);
-			*c++ = GLOBAL_SET;
-			*c++ = 0;
-		}
-
-		while (current) {
-			*c++ = GLOBAL_GET;
-			*c++ = 0;
-			gen_expr(current);
-			c += i32_store(c, 2, 0);
-
-			*c++ = GLOBAL_GET;
-			*c++ = 0;
-			c += i32_const(c, 4);
-			c += i32_sub(c);
-			*c++ = GLOBAL_SET;
-			*c++ = 0;
-
-			++arg_count;
-			current = current->next;
-		}
-
-		c += call(c, n->func_call.index);
-
-		if (arg_count) {
-			*c++ = GLOBAL_GET;
-			*c++ = 0;
-			c += i32_const(c, 4 * arg_count);
-			c += i32_add(c);
-			*c++ = GLOBAL_SET;
-			*c++ = 0;
+		for (u32 arg = extra->func_call.args; arg; arg = ctx->gen.nodes[arg].next) {
+			gen_expr(ctx, arg);
 		}
 
+		ctx->gen.c += call(ctx->gen.c, extra->func_call.index);
+		move_stack_pointer(ctx, frame_size, false);
 		return;
 	}
 
 	if (n->type == NODE_DEREF) {
-		gen_expr(n->right);
-		c += i32_load(c, 2, 0);
+		gen_expr(ctx, n->right);
+		ctx->gen.c += i32_load(ctx->gen.c, 2, 0);
 		return;
 	}
 
 	if (n->type == NODE_ADDRESS) {
-		gen_addr(n->right);
+		gen_addr(ctx, ctx->gen.nodes + n->right);
 		return;
 	}
 
 	if (n->type == NODE_NEGATE) {
-		gen_expr(n->right);
-		c += i32_const(c, -1);
-		c += i32_mul(c);
+		gen_expr(ctx, n->right);
+		ctx->gen.c += i32_const(ctx->gen.c, -1);
+		ctx->gen.c += i32_mul(ctx->gen.c);
 		return;
 	}
 
 	if (n->type == NODE_ASSIGN) {
-		gen_addr(n->left);
-		gen_expr(n->right);
-		c += i32_store(c, 2, 0);
+		node *target = ctx->gen.nodes + n->left;
+		if (target->type == NODE_VAR) {
+			if (ctx->gen.storage == VARIABLES_IN_LOCALS) {
+				gen_expr(ctx, n->right);
+				ctx->gen.c += local_tee(ctx->gen.c, variable_local(ctx, target->var.addr));
+				return;
+			}
+
+			u32 offset = frame_offset(ctx, target->var.addr);
+			ctx->gen.c += local_get(ctx->gen.c, ctx->gen.arg_count);
+			gen_expr(ctx, n->right);
+			ctx->gen.c += i32_store(ctx->gen.c, 2, offset);
+			ctx->gen.c += local_get(ctx->gen.c, ctx->gen.arg_count);
+			ctx->gen.c += i32_load(ctx->gen.c, 2, offset);
+			return;
+		}
 
-		gen_addr(n->left);
-		c += i32_load(c, 2, 0);
+		gen_addr(ctx, target);
+		gen_expr(ctx, n->right);
+		ctx->gen.c += i32_store(ctx->gen.c, 2, 0);
+
+		gen_addr(ctx, ctx->gen.nodes + n->left);
+		ctx->gen.c += i32_load(ctx->gen.c, 2, 0);
 		return;
 	}
 
 	if (n->type == NODE_INT_DECL) {
-		*c++ = LOCAL_GET;
-		*c++ = 0;
-		if (n->var.addr > 0) {
-			c += i32_const(c, n->var.addr);
-			c += i32_sub(c);
+		if (ctx->gen.storage == VARIABLES_IN_LOCALS) {
+			gen_expr(ctx, n->right);
+			ctx->gen.c += local_set(ctx->gen.c, variable_local(ctx, n->var.addr));
+		} else {
+			ctx->gen.c += local_get(ctx->gen.c, ctx->gen.arg_count);
+			gen_expr(ctx, n->right);
+			ctx->gen.c += i32_store(ctx->gen.c, 2, frame_offset(ctx, n->var.addr));
 		}
-
-		gen_expr(n->right);
-		c += i32_store(c, 2, 0);
-		c += i32_const(c, 0);
+		ctx->gen.c += i32_const(ctx->gen.c, 0);
 		return;
 	}
 
 	if (n->type == NODE_IF) {
-		gen_expr(n->if_stmt.cond);
-		c += wasm_if(c);
+		gen_expr(ctx, extra->if_stmt.cond);
+		ctx->gen.c += wasm_if(ctx->gen.c);
 
-		if (n->if_stmt.body) {
-			gen_code_block(n->if_stmt.body);
-			c += drop(c);
+		if (extra->if_stmt.body) {
+			gen_code_block(ctx, extra->if_stmt.body);
+			ctx->gen.c += drop(ctx->gen.c);
 		}
 
-		if (n->if_stmt.else_stmt) {
-			c += wasm_else(c);
-			gen_code_block(n->if_stmt.else_stmt);
-			c += drop(c);
+		if (extra->if_stmt.else_stmt) {
+			ctx->gen.c += wasm_else(ctx->gen.c);
+			gen_code_block(ctx, extra->if_stmt.else_stmt);
+			ctx->gen.c += drop(ctx->gen.c);
 		}
-		c += end_code_block(c);
+		ctx->gen.c += end_code_block(ctx->gen.c);
 
-		c += i32_const(c, 0);
+		ctx->gen.c += i32_const(ctx->gen.c, 0);
 		return;
 	}
 
 	if (n->type == NODE_LOOP) {
-		if (n->loop_stmt.start)
-			gen_expr(n->loop_stmt.start);
+		if (extra->loop_stmt.start) {
+			gen_expr(ctx, extra->loop_stmt.start);
+			ctx->gen.c += drop(ctx->gen.c);
+		}
 
-		c += loop(c);
-		c += block(c);
+		ctx->gen.c += loop(ctx->gen.c);
+		ctx->gen.c += block(ctx->gen.c);
 
-		if (n->loop_stmt.condition) {
-			gen_expr(n->loop_stmt.condition);
-			c += i32_eqz(c);
-			c += br_if(c, 0);
+		if (extra->loop_stmt.condition) {
+			gen_expr(ctx, extra->loop_stmt.condition);
+			ctx->gen.c += i32_eqz(ctx->gen.c);
+			ctx->gen.c += br_if(ctx->gen.c, 0);
 		}
 
-		if (n->loop_stmt.body) {
-			gen_code_block(n->loop_stmt.body);
-			c += drop(c);
+		if (extra->loop_stmt.body) {
+			gen_code_block(ctx, extra->loop_stmt.body);
+			ctx->gen.c += drop(ctx->gen.c);
 		}
 
-		if (n->loop_stmt.iteration) {
-			gen_code_block(n->loop_stmt.iteration);
-			c += drop(c);
+		if (extra->loop_stmt.iteration) {
+			gen_code_block(ctx, extra->loop_stmt.iteration);
+			ctx->gen.c += drop(ctx->gen.c);
 		}
 
-		c += br(c, 1);
-		c += end_code_block(c);
-		c += end_code_block(c);
-		c += i32_const(c, 0);
+		ctx->gen.c += br(ctx->gen.c, 1);
+		ctx->gen.c += end_code_block(ctx->gen.c);
+		ctx->gen.c += end_code_block(ctx->gen.c);
+		ctx->gen.c += i32_const(ctx->gen.c, 0);
 		return;
 	}
 
 	if (n->type == NODE_DO_WHILE) {
 
-		c += loop(c);
-		c += block(c);
+		ctx->gen.c += loop(ctx->gen.c);
+		ctx->gen.c += block(ctx->gen.c);
 
-		if (n->loop_stmt.body) {
-			gen_code_block(n->loop_stmt.body);
-			c += drop(c);
+		if (extra->loop_stmt.body) {
+			gen_code_block(ctx, extra->loop_stmt.body);
+			ctx->gen.c += drop(ctx->gen.c);
 		}
 
-		gen_expr(n->loop_stmt.condition);
-		c += i32_eqz(c);
-		c += br_if(c, 0);
+		gen_expr(ctx, extra->loop_stmt.condition);
+		ctx->gen.c += i32_eqz(ctx->gen.c);
+		ctx->gen.c += br_if(ctx->gen.c, 0);
 
-		c += br(c, 1);
-		c += end_code_block(c);
-		c += end_code_block(c);
-		c += i32_const(c, 0);
+		ctx->gen.c += br(ctx->gen.c, 1);
+		ctx->gen.c += end_code_block(ctx->gen.c);
+		ctx->gen.c += end_code_block(ctx->gen.c);
+		ctx->gen.c += i32_const(ctx->gen.c, 0);
 		return;
 	}
 
 	if (n->type == NODE_RETURN) {
-		gen_expr(n->right);
-		c += wasm_return(c);
+		gen_expr(ctx, n->right);
+		release_frame(ctx);
+		ctx->gen.c += wasm_return(ctx->gen.c);
 		return;
 	}
 
-	gen_expr(n->left);
-	gen_expr(n->right);
+	gen_expr(ctx, n->left);
+	gen_expr(ctx, n->right);
+	gen_binary(ctx, n->type);
+}
 
-	switch (n->type) {
-		case NODE_PLUS: {
-			c += i32_add(c);
-		} break;
-		case NODE_MINUS: {
-			c += i32_sub(c);
-		} break;
-		case NODE_MULTIPLY: {
-			c += i32_mul(c);
-		} break;
-		case NODE_DIVIDE: {
-			c += i32_div_s(c);
-		} break;
-		case NODE_EQ: {
-			c += i32_eq(c);
-		} break;
-		case NODE_NE: {
-			c += i32_ne(c);
-		} break;
-		case NODE_GT: {
-			c += i32_gt_s(c);
-		} break;
-		case NODE_LT: {
-			c += i32_lt_s(c);
-		} break;
-		case NODE_GE: {
-			c += i32_ge_s(c);
-		} break;
-		case NODE_LE: {
-			c += i32_le_s(c);
-		} break;
-	}
+// Direct emit: parse_body_direct calls these as it parses, each writes
+// one construct at the end of the current function body. Positions are offsets
+// from the start of the output, like the tree path keeps them.
+void emit_function_begin(compiler_ctx *ctx, func *f) {
+	function_begin(ctx, f);
+}
+
+void emit_function_end(compiler_ctx *ctx) {
+	function_end(ctx);
+}
+
+u32 emit_position(compiler_ctx *ctx) {
+	return ctx->gen.c - ctx->gen.code_start;
+}
+
+void emit_truncate(compiler_ctx *ctx, u32 position) {
+	ctx->gen.c = ctx->gen.code_start + position;
+}
+
+// writes length bytes of already emitted code again, from position
+void emit_copy(compiler_ctx *ctx, u32 position, u32 length) {
+	reserve_code(ctx, length + MAX_NODE_OUTPUT);
+	__builtin_memcpy(ctx->gen.c, ctx->gen.code_start + position, length);
+	ctx->gen.c += length;
+}
+
+// takes the code from position to the end out of the output and returns it in AST scratch
+u8 *emit_cut(compiler_ctx *ctx, u32 position, u32 *length) {
+	*length = ctx->gen.c - ctx->gen.code_start - position;
+	u8 *code = bump_alloc(ctx, ARENA_AST, *length);
+	__builtin_memcpy(code, ctx->gen.code_start + position, *length);
+	ctx->gen.c = ctx->gen.code_start + position;
+	return code;
+}
+
+void emit_bytes(compiler_ctx *ctx, u8 *bytes, u32 length) {
+	reserve_code(ctx, length + MAX_NODE_OUTPUT);
+	__builtin_memcpy(ctx->gen.c, bytes, length);
+	ctx->gen.c += length;
+}
+
+void emit_int(compiler_ctx *ctx, i32 value) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.c += i32_const(ctx->gen.c, value);
+}
+
+void emit_var_addr(compiler_ctx *ctx, u32 addr) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	gen_var_addr(ctx, addr);
+}
+
+void emit_load(compiler_ctx *ctx) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.c += i32_load(ctx->gen.c, 2, 0);
+}
+
+void emit_store(compiler_ctx *ctx) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.c += i32_store(ctx->gen.c, 2, 0);
+}
+
+void emit_binary(compiler_ctx *ctx, node_type type) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	gen_binary(ctx, type);
+}
+
+void emit_drop(compiler_ctx *ctx) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.c += drop(ctx->gen.c);
+}
+
+void emit_return(compiler_ctx *ctx) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.c += wasm_return(ctx->gen.c);
+}
+
+void emit_if(compiler_ctx *ctx) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.c += wasm_if(ctx->gen.c);
+}
+
+void emit_else(compiler_ctx *ctx) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.c += wasm_else(ctx->gen.c);
+}
+
+// closes an if, which like every statement leaves a value
+void emit_if_end(compiler_ctx *ctx) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.c += end_code_block(ctx->gen.c);
+	ctx->gen.c += i32_const(ctx->gen.c, 0);
+}
+
+void emit_loop_begin(compiler_ctx *ctx) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.c += loop(ctx->gen.c);
+	ctx->gen.c += block(ctx->gen.c);
+}
+
+// leaves the loop when the condition on the stack is false
+void emit_loop_exit_unless(compiler_ctx *ctx) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.c += i32_eqz(ctx->gen.c);
+	ctx->gen.c += br_if(ctx->gen.c, 0);
+}
+
+void emit_loop_end(compiler_ctx *ctx) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.c += br(ctx->gen.c, 1);
+	ctx->gen.c += end_code_block(ctx->gen.c);
+	ctx->gen.c += end_code_block(ctx->gen.c);
+	ctx->gen.c += i32_const(ctx->gen.c, 0);
+}
+
+// The arguments are left on the operand stack, a call inside one of them
+// builds its frame below the caller's.
+void emit_call_begin(compiler_ctx *ctx, u32 stack_pointer) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	move_stack_pointer(ctx, call_frame_size(ctx, stack_pointer), true);
+}
+
+void emit_call_end(compiler_ctx *ctx, u32 func_idx, u32 stack_pointer) {
+	reserve_code(ctx, MAX_NODE_OUTPUT);
+	ctx->gen.c += call(ctx->gen.c, func_idx);
+	move_stack_pointer(ctx, call_frame_size(ctx, stack_pointer), false);
 }
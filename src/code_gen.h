@@ -1,5 +1,6 @@
 #pragma once
 #include "parser.h"
+#include "peephole.h"
 
 typedef struct compile_result compile_result;
 struct compile_result {
@@ -7,4 +8,79 @@ struct compile_result {
 	u8 *code;
 };
 
-compile_result *gen_code(func *ast, u32 function_count);
+// one source's outcome in compile_batch, code holds the error message if it failed
+typedef struct batch_result batch_result;
+struct batch_result {
+	u32 length;
+	u8 *code;
+	u32 failed;
+};
+
+typedef struct function_cache function_cache;
+typedef struct cached_function cached_function;
+
+// where the function being generated keeps its variables
+typedef enum variable_storage variable_storage;
+enum variable_storage {
+	VARIABLES_ON_STACK, // direct emit, below a frame pointer that callers move the stack pointer past
+	VARIABLES_IN_FRAME, // at offsets from the bottom of a frame the function reserves for itself
+	VARIABLES_IN_LOCALS,
+};
+
+// c is where the next byte goes, in the reservation between code_start and code_limit
+typedef struct code_gen_state code_gen_state;
+struct code_gen_state {
+	u8 *c;
+	u8 *code_start;
+	u8 *code_limit;
+	node *nodes;
+	bool error_occurred;
+
+	function_cache *cache;
+	cached_function *compiled;
+	u32 compiled_count;
+	u32 compiled_capacity;
+	u64 function_hash;
+	u32 function_start;
+	u32 header_gap; // bytes in front of the first body
+	u32 instructions_start; // of the function being written, behind its locals
+	u32 peephole_hits[PEEPHOLE_RULE_COUNT];
+
+	// of the function being generated, see gen_function
+	variable_storage storage;
+	u32 arg_count;
+	u32 frame_size;
+};
+
+void gen_begin(compiler_ctx *ctx);
+// writes the code the last module had for a function with the same hash, if there was one
+bool gen_cached(compiler_ctx *ctx, func *f);
+void gen_clear_cache(compiler_ctx *ctx);
+void gen_function(compiler_ctx *ctx, func *f);
+// appends the bodies another context compiled, in order after the ones written so far
+void gen_append(compiler_ctx *ctx, compiler_ctx *from);
+compile_result *gen_end(compiler_ctx *ctx, func *functions, u32 function_count);
+
+// Direct emit, written to by the parser while it parses instead of through nodes
+void emit_function_begin(compiler_ctx *ctx, func *f);
+void emit_function_end(compiler_ctx *ctx);
+u32 emit_position(compiler_ctx *ctx);
+void emit_truncate(compiler_ctx *ctx, u32 position);
+void emit_copy(compiler_ctx *ctx, u32 position, u32 length);
+u8 *emit_cut(compiler_ctx *ctx, u32 position, u32 *length);
+void emit_bytes(compiler_ctx *ctx, u8 *bytes, u32 length);
+void emit_int(compiler_ctx *ctx, i32 value);
+void emit_var_addr(compiler_ctx *ctx, u32 addr);
+void emit_load(compiler_ctx *ctx);
+void emit_store(compiler_ctx *ctx);
+void emit_binary(compiler_ctx *ctx, node_type type);
+void emit_drop(compiler_ctx *ctx);
+void emit_return(compiler_ctx *ctx);
+void emit_if(compiler_ctx *ctx);
+void emit_else(compiler_ctx *ctx);
+void emit_if_end(compiler_ctx *ctx);
+void emit_loop_begin(compiler_ctx *ctx);
+void emit_loop_exit_unless(compiler_ctx *ctx);
+void emit_loop_end(compiler_ctx *ctx);
+void emit_call_begin(compiler_ctx *ctx, u32 stack_pointer);
+void emit_call_end(compiler_ctx *ctx, u32 func_idx, u32 stack_pointer);
@@ -60,6 +60,61 @@ u8 encode_integer_length(i32 value) {
 	return leb128_encode_len(value);
 }
 
+u8 encode_padded_integer(u8 *c, u32 value) {
+	for (u32 i = 0; i < PADDED_INTEGER_LENGTH - 1; ++i) {
+		c[i] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	c[PADDED_INTEGER_LENGTH - 1] = value;
+	return PADDED_INTEGER_LENGTH;
+}
+
+i32 decode_integer(u8 *c, u8 *length) {
+	u32 value = 0;
+	u32 shift = 0;
+	u8 byte;
+	*length = 0;
+	do {
+		byte = c[(*length)++];
+		value |= (u32)(byte & 0x7F) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+
+	if (shift < 32 && (byte & 0x40)) value |= ~0u << shift;
+	return value;
+}
+
+static u32 immediate_length(u8 *c) {
+	u32 length = 1;
+	while (*c++ & 0x80) ++length;
+	return length;
+}
+
+u32 instruction_length(u8 *c) {
+	switch (*c) {
+		case I32_CONST:
+		case LOCAL_GET:
+		case LOCAL_SET:
+		case LOCAL_TEE:
+		case GLOBAL_GET:
+		case GLOBAL_SET:
+		case BR:
+		case BR_IF:
+		case CALL:
+			return 1 + immediate_length(c + 1);
+		case I32_LOAD:
+		case I32_STORE: {
+			u32 alignment_length = immediate_length(c + 1);
+			return 1 + alignment_length + immediate_length(c + 1 + alignment_length);
+		}
+		case BLOCK:
+		case LOOP:
+		case IF:
+			return 2;
+	}
+	return 1;
+}
+
 
 u8 create_module(u8 *c) {
 	c[0] = 0;
@@ -79,28 +134,51 @@ u8 end_module(u8 *c) {
 	return 0;
 }
 
-u8 create_wasm_layout(u8 *c, func *bst, u32 function_count) {
+u32 create_wasm_layout(compiler_ctx *ctx, u8 *c, func **functions, u32 function_count, bool export_main_only) {
 
 	u8 *start = c;
 
-	c[0] = SECTION_TYPE;
-	c[1] = 0x5;
-
-	c[2] = 0x1;
-	c[3] = 0x60;
-	c[4] = 0x0;
-	c[5] = 0x1;
-	c[6] = VALTYPE_I32;
+	// one type per arity, (i32 x arity) -> i32, in the order the arities first appear
+	u32 max_arity = 0;
+	for (u32 i = 0; i < function_count; ++i) {
+		max_arity = max(max_arity, functions[i]->arg_count);
+	}
+	u32 *type_of_arity = bump_alloc(ctx, ARENA_AST, sizeof(u32) * (max_arity + 1));
+	u32 *arity_of_type = bump_alloc(ctx, ARENA_AST, sizeof(u32) * (max_arity + 1));
+	__builtin_memset(type_of_arity, 0xFF, sizeof(u32) * (max_arity + 1));
+	u32 type_count = 0;
+	for (u32 i = 0; i < function_count; ++i) {
+		u32 arity = functions[i]->arg_count;
+		if (type_of_arity[arity] != 0xFFFFFFFF) continue;
+		type_of_arity[arity] = type_count;
+		arity_of_type[type_count++] = arity;
+	}
 
-	c += 7;
+	// Sections are written in one pass, each size into a padded slot once
+	// what it measures is written.
+	*c++ = SECTION_TYPE;
+	u8 *section_size = c;
+	c += PADDED_INTEGER_LENGTH;
+	c += encode_integer(c, type_count);
+	for (u32 type = 0; type < type_count; ++type) {
+		u32 arity = arity_of_type[type];
+		*c++ = 0x60;
+		c += encode_integer(c, arity);
+		__builtin_memset(c, VALTYPE_I32, arity);
+		c += arity;
+		*c++ = 0x1;
+		*c++ = VALTYPE_I32;
+	}
+	encode_padded_integer(section_size, c - section_size - PADDED_INTEGER_LENGTH);
 
-	c[0] = SECTION_FUNC;
-	c[1] = 1 + function_count;
-	c[2] = function_count;
-	c += 3;
+	*c++ = SECTION_FUNC;
+	section_size = c;
+	c += PADDED_INTEGER_LENGTH;
+	c += encode_integer(c, function_count);
 	for (u32 i = 0; i < function_count; ++i) {
-		*c++ = 0;
+		c += encode_integer(c, type_of_arity[functions[i]->arg_count]);
 	}
+	encode_padded_integer(section_size, c - section_size - PADDED_INTEGER_LENGTH);
 
 	c[0] = SECTION_MEM;
 	c[1] = 0x3;
@@ -118,26 +196,27 @@ u8 create_wasm_layout(u8 *c, func *bst, u32 function_count) {
 	c += encode_integer(c, PAGE_SIZE - 4); // length of 3
 	*c++ = 0xB;
 
-	*c++ = SECTION_EXPORT;
-	u8 *export_length = c++;
-
-	func *function_stack[function_count];
-	function_stack[0] = bst;
-	u32 function_stack_length = 1;
+	u32 export_count = 0;
+	for (u32 i = 0; i < function_count; ++i) {
+		export_count += !export_main_only || functions[i]->symbol == SYMBOL_MAIN;
+	}
 
-	*c++ = function_count;
+	*c++ = SECTION_EXPORT;
+	section_size = c;
+	c += PADDED_INTEGER_LENGTH;
+	c += encode_integer(c, export_count);
 	for (u32 i = 0; i < function_count; ++i) {
-		func *f = function_stack[--function_stack_length];
-		*c++ = f->identifier.length;
-		__builtin_memcpy(c, f->identifier.name, f->identifier.length);
-		c += f->identifier.length;
+		func *f = functions[i];
+		if (export_main_only && f->symbol != SYMBOL_MAIN) continue;
+
+		identifier name = symbol_name(ctx, f->symbol);
+		c += encode_integer(c, name.length);
+		__builtin_memcpy(c, name.name, name.length);
+		c += name.length;
 		*c++ = 0x0;
-		*c++ = f->func_idx;
-		if (f->right) function_stack[function_stack_length++] = f->right;
-		if (f->left) function_stack[function_stack_length++] = f->left;
+		c += encode_integer(c, i);
 	}
-
-	*export_length = c - export_length - 1;
+	encode_padded_integer(section_size, c - section_size - PADDED_INTEGER_LENGTH);
 
 	return c - start;
 }
@@ -267,6 +346,21 @@ u8 call(u8 *c, u32 index) {
 	return leb128_encode(c, index) + 1;
 }
 
+u8 local_get(u8 *c, u32 index) {
+	*c++ = LOCAL_GET;
+	return leb128_encode(c, index) + 1;
+}
+
+u8 local_set(u8 *c, u32 index) {
+	*c++ = LOCAL_SET;
+	return leb128_encode(c, index) + 1;
+}
+
+u8 local_tee(u8 *c, u32 index) {
+	*c++ = LOCAL_TEE;
+	return leb128_encode(c, index) + 1;
+}
+
 u8 end_code_block(u8 *c) {
 	*c = 0xB;
 	return 1;
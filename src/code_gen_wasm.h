@@ -5,11 +5,18 @@
 u8 create_module(u8 *c);
 u8 end_module(u8 *c);
 
-u8 create_wasm_layout(u8 *c, func *bst, u32 function_count);
+// the module up to the code section, with functions[i] at index i
+u32 create_wasm_layout(compiler_ctx *ctx, u8 *c, func **functions, u32 function_count, bool export_main_only);
 u8 end_code_block(u8 *c);
 
 u8 encode_integer(u8 *c, i32 value);
 u8 encode_integer_length(i32 value);
+// a size written before what it measures is, into a slot that fits any u32
+#define PADDED_INTEGER_LENGTH 5
+u8 encode_padded_integer(u8 *c, u32 value);
+i32 decode_integer(u8 *c, u8 *length);
+// the length of the instruction at c, for the instructions code_gen writes
+u32 instruction_length(u8 *c);
 
 u8 i32_const(u8 *c, i32 value);
 u8 i32_add(u8 *c);
@@ -34,6 +41,9 @@ u8 br_if(u8 *c, u32 index);
 u8 loop(u8 *c);
 u8 block(u8 *c);
 u8 call(u8 *c, u32 index);
+u8 local_get(u8 *c, u32 index);
+u8 local_set(u8 *c, u32 index);
+u8 local_tee(u8 *c, u32 index);
 
 u8 i32_load(u8 *c, u32 alignment, u32 offset);
 u8 i32_store(u8 *c, u32 alignment, u32 offset);
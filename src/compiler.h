@@ -0,0 +1,33 @@
+#pragma once
+#include "memory.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "optimizer.h"
+#include "code_gen.h"
+
+#define MAX_FUNCTION_CHUNKS 64
+
+// a run of functions compile_chunk compiles on its own, in a context of its own
+typedef struct function_chunk function_chunk;
+struct function_chunk {
+	u32 first;
+	u32 end;
+	compiler_ctx *ctx;
+};
+
+// Everything one compile works on. Contexts only share the heap their arenas
+// take blocks from, so separate contexts can compile at the same time, on
+// worker instances over shared memory in the threaded build.
+struct compiler_ctx {
+	memory_state memory;
+	tokenizer_state tokenizer;
+	parser_state parser;
+	code_gen_state gen;
+	bool direct_emit;
+	bool export_main_only;
+
+	function_chunk *function_chunks;
+	u32 function_chunk_count;
+	func *pending_function; // the first function whose body couldn't be skipped, compiled after the chunks
+	compiler_ctx *chunk_ctxs[MAX_FUNCTION_CHUNKS]; // created on first use and kept for their memory
+};
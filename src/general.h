@@ -20,6 +20,9 @@ typedef int64_t i64;
 #define max(a, b) ((a > b) ? a : b)
 #define min(a, b) ((a < b) ? a : b)
 
+// all the state of one compile, see compiler.h
+typedef struct compiler_ctx compiler_ctx;
+
 typedef struct identifier identifier;
 struct identifier {
 	char *name;
@@ -1,12 +1,234 @@
-#include "memory.h"
-#include "tokenizer.h"
-#include "parser.h"
-#include "code_gen.h"
+#include "compiler.h"
+
+// A context holds everything one compile works on, each caller compiling in
+// parallel creates its own and passes it to every export below.
+__attribute__((export_name("create_compiler_ctx")))
+compiler_ctx *create_compiler_ctx() {
+	compiler_ctx *ctx = heap_alloc(sizeof(compiler_ctx));
+	__builtin_memset(ctx, 0, sizeof(compiler_ctx));
+	return ctx;
+}
+
+// lexes without parsing so the tokenizer can be timed on its own
+__attribute__((export_name("tokenize")))
+u32 tokenize(compiler_ctx *ctx, char *src, u32 length) {
+	u32 token_count = tokenizer_init(ctx, src, length);
+	bump_set_mark(ctx);
+	return token_count;
+}
+
+// Direct emit compiles in one pass without building an AST, which is faster
+// but skips the optimizations done on the tree. Off by default.
+__attribute__((export_name("set_direct_emit")))
+void set_direct_emit(compiler_ctx *ctx, bool enabled) {
+	if (enabled != ctx->direct_emit) gen_clear_cache(ctx);
+	ctx->direct_emit = enabled;
+}
+
+// Exporting only main leaves out the functions main doesn't reach through its
+// calls. Off by default, which exports every function.
+__attribute__((export_name("set_export_main_only")))
+void set_export_main_only(compiler_ctx *ctx, bool enabled) {
+	ctx->export_main_only = enabled;
+}
+
+// Functions whose code the last module already has are copied from it
+// without parsing them. The others are emitted as soon as they're parsed and
+// their nodes are released right after, so only one function's AST is ever in
+// memory. Pure functions keep a copy of theirs, calls to them are evaluated
+// on it, so they're parsed even when cached.
+static bool compile_body(compiler_ctx *ctx, func *f) {
+	if (f->pure_nodes) {
+		if (!gen_cached(ctx, f)) {
+			f->nodes = f->pure_nodes;
+			gen_function(ctx, f);
+		}
+		return true;
+	}
+
+	if (gen_cached(ctx, f)) {
+		if (f->pure && !ctx->direct_emit) {
+			if (!parse_body(ctx)) return false;
+			bump_reset(ctx, ARENA_AST);
+		} else {
+			skip_body(ctx);
+		}
+		return true;
+	}
+
+	if (ctx->direct_emit) {
+		if (!parse_body_direct(ctx)) return false;
+	} else {
+		if (!parse_body(ctx)) return false;
+		gen_function(ctx, f);
+	}
+	bump_reset(ctx, ARENA_AST);
+	return true;
+}
+
+static void compile_functions(compiler_ctx *ctx) {
+	func *f;
+	while ((f = parse_signature(ctx))) {
+		if (!compile_body(ctx, f)) break;
+	}
+}
+
+static compile_result *compile_end(compiler_ctx *ctx) {
+	u32 function_count = 0;
+	func *functions = parsed_functions(ctx, &function_count);
+	if (!functions) {
+		// the last module and its cache stay for the next recompile
+		bump_reset(ctx, ARENA_OUTPUT);
+		bump_swap(ctx, ARENA_OUTPUT, ARENA_PREVIOUS_OUTPUT);
+		return 0;
+	}
+
+	compile_result *result = gen_end(ctx, functions, function_count);
+	bump_reset(ctx, ARENA_PREVIOUS_OUTPUT);
+	return result;
+}
 
 __attribute__((export_name("compile")))
-compile_result *compile(char *src, u32 length) {
-	tokenizer_init(src, length);
+compile_result *compile(compiler_ctx *ctx, char *src, u32 length) {
+	tokenizer_init(ctx, src, length);
+	bump_set_mark(ctx);
+	parse_begin(ctx);
+	gen_begin(ctx);
+	compile_functions(ctx);
+	return compile_end(ctx);
+}
+
+// compiles the source edited through edit_src_code without lexing it again
+__attribute__((export_name("recompile")))
+compile_result *recompile(compiler_ctx *ctx) {
+	bump_rewind(ctx);
+	tokenizer_reset(ctx);
+	parse_begin(ctx);
+	gen_begin(ctx);
+	compile_functions(ctx);
+	return compile_end(ctx);
+}
+
+// Compiles count sources packed one after another, each as its u32 length
+// (including the null terminator) followed by its bytes, padded to 4 bytes.
+// Every source reuses the blocks the one before it released, and its module or
+// error is copied next to the sources, so all results stay valid until the next
+// bump_alloc_src_code. The context is left as if the last source was compiled.
+__attribute__((export_name("compile_batch")))
+batch_result *compile_batch(compiler_ctx *ctx, u8 *sources, u32 count) {
+	batch_result *results = bump_alloc(ctx, ARENA_SOURCE, sizeof(batch_result) * count);
+
+	for (u32 i = 0; i < count; ++i) {
+		u32 length = *(u32 *)sources;
+		char *src = (char *)sources + sizeof(u32);
+		sources += sizeof(u32) + ((length + 3) & ~3);
+
+		for (u32 id = ARENA_FRONT_END; id < ARENA_COUNT; ++id) bump_reset(ctx, id);
+		compile_result *result = compile(ctx, src, length);
+
+		u8 *data = (result) ? result->code : (u8 *)ctx->tokenizer.error_msg;
+		u32 data_length = (result) ? result->length : ctx->tokenizer.error_msg_len;
+		results[i] = (batch_result){ data_length, bump_alloc(ctx, ARENA_SOURCE, data_length), !result };
+		__builtin_memcpy(results[i].code, data, data_length);
+	}
+
+	return results;
+}
+
+// Parallel compiles recompile the source that compile, tokenize or the parallel
+// lexer left behind. compile_parallel_begin parses every signature and skips
+// the bodies, which the hashes already measured, then splits the functions
+// into runs of about equal tokens. Pure functions are parsed here already so
+// every chunk can evaluate calls to them. compile_chunk compiles one run into the
+// chunk's own context, which shares this one's tokens and functions but not
+// its arenas, so every chunk can run on its own thread. compile_parallel_end
+// appends the chunks' code in order and reports the first error a chunk hit,
+// which is the one a serial compile would have stopped at.
+__attribute__((export_name("compile_parallel_begin")))
+u32 compile_parallel_begin(compiler_ctx *ctx, u32 requested_chunks) {
+	bump_rewind(ctx);
+	tokenizer_reset(ctx);
+	parse_begin(ctx);
+	gen_begin(ctx);
+
+	u32 total_tokens = 0;
 	u32 function_count = 0;
-	func *ast = parse_tokens(&function_count);
-	return (ast != 0) ? gen_code(ast, function_count) : 0;
+	ctx->pending_function = 0;
+
+	func *f;
+	while ((f = parse_signature(ctx))) {
+		// an unterminated body is left to the serial compile, which reports it
+		if (!f->body_tokens) {
+			ctx->pending_function = f;
+			break;
+		}
+		if (f->pure && !ctx->direct_emit) {
+			if (!parse_body(ctx)) break;
+			bump_reset(ctx, ARENA_AST);
+		} else {
+			skip_body(ctx);
+		}
+		total_tokens += f->body_tokens;
+		function_count += 1;
+	}
+
+	requested_chunks = min(max(requested_chunks, 1), MAX_FUNCTION_CHUNKS);
+	ctx->function_chunks = bump_alloc(ctx, ARENA_FRONT_END, sizeof(function_chunk) * requested_chunks);
+	ctx->function_chunk_count = 0;
+
+	func *functions = ctx->parser.functions;
+	u32 first = 0;
+	u32 tokens = 0;
+	for (u32 i = 0; i < function_count; ++i) {
+		tokens += functions[i].body_tokens;
+		u32 chunk = ctx->function_chunk_count;
+		bool full = (u64)tokens * requested_chunks >= (u64)total_tokens * (chunk + 1);
+		if (i + 1 < function_count && !(full && chunk + 1 < requested_chunks)) continue;
+
+		if (!ctx->chunk_ctxs[chunk]) ctx->chunk_ctxs[chunk] = create_compiler_ctx();
+		ctx->function_chunks[chunk] = (function_chunk){ first, i + 1, ctx->chunk_ctxs[chunk] };
+		ctx->function_chunk_count += 1;
+		first = i + 1;
+	}
+
+	return ctx->function_chunk_count;
+}
+
+__attribute__((export_name("compile_chunk")))
+void compile_chunk(compiler_ctx *ctx, u32 index) {
+	function_chunk *k = ctx->function_chunks + index;
+	compiler_ctx *chunk_ctx = k->ctx;
+
+	for (u32 i = 0; i < ARENA_COUNT; ++i) bump_reset(chunk_ctx, i);
+	chunk_ctx->tokenizer = ctx->tokenizer;
+	chunk_ctx->parser = ctx->parser;
+	tokenizer_reset(chunk_ctx);
+	chunk_ctx->parser.error_occurred = false;
+	chunk_ctx->direct_emit = ctx->direct_emit;
+	gen_begin(chunk_ctx);
+	chunk_ctx->gen.cache = ctx->gen.cache;
+
+	for (u32 i = k->first; i < k->end; ++i) {
+		func *f = ctx->parser.functions + i;
+		seek_body(chunk_ctx, f);
+		if (!compile_body(chunk_ctx, f)) return;
+	}
+}
+
+__attribute__((export_name("compile_parallel_end")))
+compile_result *compile_parallel_end(compiler_ctx *ctx) {
+	for (u32 i = 0; i < ctx->function_chunk_count; ++i) {
+		compiler_ctx *chunk_ctx = ctx->function_chunks[i].ctx;
+		if (chunk_ctx->parser.error_occurred) {
+			__builtin_memcpy(ctx->tokenizer.error_msg, chunk_ctx->tokenizer.error_msg, sizeof(ctx->tokenizer.error_msg));
+			ctx->tokenizer.error_msg_len = chunk_ctx->tokenizer.error_msg_len;
+			ctx->parser.error_occurred = true;
+			return compile_end(ctx);
+		}
+		gen_append(ctx, chunk_ctx);
+	}
+
+	func *f = ctx->pending_function;
+	if (f && compile_body(ctx, f)) compile_functions(ctx);
+	return compile_end(ctx);
 }
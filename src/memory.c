@@ -1,29 +1,207 @@
-#include "memory.h"
+#include "compiler.h"
 
-static void *alloc_ptr = PAGE_SIZE * 2;
+// set by the linker behind the static data and the stack
+extern u8 __heap_base;
 
-// TODO: Page Allocation
-void *bump_alloc(u32 size) {
-	const u32 alignment = 4;
+// memory is grown at least this many pages at a time so large sources don't call memory.grow per allocation
+#define HEAP_GROW_PAGES 16
 
-	size += (4 - (size % 4));
+// the SIMD scanners read whole vectors, so a few bytes past the last allocation must stay readable
+#define HEAP_SLACK 64
 
-	void *ptr = (void *)alloc_ptr;
-	alloc_ptr += size;
+// Every arena is a chain of blocks taken from the heap. Releasing memory puts
+// blocks on the context's free list, where any of its arenas can pick them up
+// again. The heap itself only grows, contexts running on other threads take
+// their blocks from it with an atomic add.
+struct arena_block {
+	arena_block *next; // the arena's previous block, or the next free block
+	u32 size;          // including this header
+	u32 used_before;   // what the arena had allocated when this block was opened
+};
+
+static u8 *heap_top = &__heap_base;
+
+static void heap_ensure(u8 *end) {
+	u32 required = (u32)end + HEAP_SLACK;
+	u32 pages = __builtin_wasm_memory_size(0);
+	if (required <= pages * PAGE_SIZE) return;
+
+	u32 pages_needed = (required - pages * PAGE_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+	if ((i32)__builtin_wasm_memory_grow(0, max(pages_needed, HEAP_GROW_PAGES)) < 0) {
+		__builtin_trap();
+	}
+}
+
+void *heap_alloc(u32 size) {
+	size = (size + 15) & ~15;
+	u8 *ptr = __atomic_fetch_add(&heap_top, size, __ATOMIC_RELAXED);
+	heap_ensure(ptr + size);
 	return ptr;
 }
 
+static arena_block *take_block(compiler_ctx *ctx, u32 size) {
+	u32 pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	size = max(pages, 1) * PAGE_SIZE;
+
+	// best fit, a context reuses its blocks for every new source so a small
+	// allocation taking a big block would push the next big one onto the heap
+	arena_block **best = 0;
+	for (arena_block **link = &ctx->memory.free_blocks; *link; link = &(*link)->next) {
+		u32 block_size = (*link)->size;
+		if (block_size >= size && (!best || block_size < (*best)->size)) {
+			best = link;
+			if (block_size == size) break;
+		}
+	}
+
+	if (best) {
+		arena_block *block = *best;
+		*best = block->next;
+		return block;
+	}
+
+	arena_block *block = heap_alloc(size);
+	block->size = size;
+	return block;
+}
+
+static u32 arena_used(arena *a) {
+	return (a->block) ? a->block->used_before + (a->ptr - (u8 *)(a->block + 1)) : 0;
+}
+
+static void open_block(compiler_ctx *ctx, arena *a, u32 size) {
+	u32 used = arena_used(a);
+	arena_block *block = take_block(ctx, size + sizeof(arena_block));
+	block->next = a->block;
+	block->used_before = used;
+
+	a->block = block;
+	a->ptr = (u8 *)(block + 1);
+	a->end = (u8 *)block + block->size;
+}
+
+void *bump_alloc(compiler_ctx *ctx, arena_id id, u32 size) {
+	arena *a = ctx->memory.arenas + id;
+	size = (size + 3) & ~3;
+
+	if (a->ptr + size > a->end) open_block(ctx, a, size);
+
+	u8 *ptr = a->ptr;
+	a->ptr += size;
+	a->peak = max(a->peak, arena_used(a));
+	return ptr;
+}
+
+// A new source starts a new document, so every arena is emptied. Nothing is
+// zeroed, allocations are initialized by whoever takes them. The one exception
+// is the source's null terminator which the caller doesn't write.
 __attribute__((export_name("bump_alloc_src_code")))
-void *bump_alloc_src_code(u32 size) {
-	void *start = (u8 *)(PAGE_SIZE * 2);
-	u32 bytes_to_zero = (u8 *)alloc_ptr - (u8 *)start;
+void *bump_alloc_src_code(compiler_ctx *ctx, u32 size) {
+	for (u32 i = 0; i < ARENA_COUNT; ++i) bump_reset(ctx, i);
+	__builtin_memset(ctx->memory.arenas, 0, sizeof(ctx->memory.arenas));
+
+	u8 *code = bump_alloc(ctx, ARENA_SOURCE, size);
+	if (size) code[size - 1] = 0;
+	return code;
+}
 
-	__builtin_memset(start, 0, bytes_to_zero);
+arena_checkpoint bump_checkpoint(compiler_ctx *ctx, arena_id id) {
+	arena *a = ctx->memory.arenas + id;
+	return (arena_checkpoint){ a->block, a->ptr };
+}
 
-	if (__builtin_wasm_memory_size(0) == 2) {
-		__builtin_wasm_memory_grow(0, 1);
+// Releases everything allocated since the checkpoint, which stays valid only
+// while nothing before it is released.
+void bump_restore(compiler_ctx *ctx, arena_id id, arena_checkpoint checkpoint) {
+	arena *a = ctx->memory.arenas + id;
+	while (a->block != checkpoint.block) {
+		arena_block *block = a->block;
+		a->block = block->next;
+		block->next = ctx->memory.free_blocks;
+		ctx->memory.free_blocks = block;
 	}
 
-	alloc_ptr = start;
-	return bump_alloc(size);
+	a->ptr = checkpoint.ptr;
+	a->end = (a->block) ? (u8 *)a->block + a->block->size : 0;
+	a->reserved = 0;
+}
+
+void bump_reset(compiler_ctx *ctx, arena_id id) {
+	bump_restore(ctx, id, (arena_checkpoint){0});
+}
+
+void bump_swap(compiler_ctx *ctx, arena_id a, arena_id b) {
+	arena *arenas = ctx->memory.arenas;
+	arena swapped = arenas[a];
+	arenas[a] = arenas[b];
+	arenas[b] = swapped;
+}
+
+bool bump_empty(compiler_ctx *ctx, arena_id id) {
+	return arena_used(ctx->memory.arenas + id) == 0;
+}
+
+// Front-end allocations made before the mark survive bump_rewind, that's how
+// the source's tokens and symbols are kept between an edit and the next
+// recompile. Everything a compile produced after them is released, except the
+// last module which moves to ARENA_PREVIOUS_OUTPUT until the caller is done with it.
+void bump_set_mark(compiler_ctx *ctx) {
+	ctx->memory.arenas[ARENA_FRONT_END].mark = bump_checkpoint(ctx, ARENA_FRONT_END);
+}
+
+void bump_rewind(compiler_ctx *ctx) {
+	arena *arenas = ctx->memory.arenas;
+	bump_restore(ctx, ARENA_FRONT_END, arenas[ARENA_FRONT_END].mark);
+	bump_reset(ctx, ARENA_AST);
+
+	// an edit and the recompile after it both rewind, the second finds the output already moved
+	if (arena_used(arenas + ARENA_OUTPUT)) {
+		bump_reset(ctx, ARENA_PREVIOUS_OUTPUT);
+		bump_swap(ctx, ARENA_OUTPUT, ARENA_PREVIOUS_OUTPUT);
+	}
+
+	arenas[ARENA_FRONT_END].peak = arena_used(arenas + ARENA_FRONT_END);
+	arenas[ARENA_AST].peak = 0;
+	arenas[ARENA_OUTPUT].peak = 0;
+}
+
+// Output of unknown length is written straight into the top of an arena.
+// Reserve makes sure size bytes there are free without allocating them, and
+// moves what the previous reservation held if they don't fit in the current
+// block, so the caller has to use the returned pointer from then on. Commit
+// allocates what was actually written.
+void *bump_reserve(compiler_ctx *ctx, arena_id id, u32 size) {
+	arena *a = ctx->memory.arenas + id;
+
+	if (a->ptr + size > a->end) {
+		u8 *reservation = a->ptr;
+		u32 kept = min(a->reserved, size);
+		open_block(ctx, a, size);
+		__builtin_memcpy(a->ptr, reservation, kept);
+	}
+
+	a->reserved = size;
+	a->peak = max(a->peak, arena_used(a) + size);
+	return a->ptr;
+}
+
+void bump_commit(compiler_ctx *ctx, arena_id id, u32 size) {
+	ctx->memory.arenas[id].reserved = 0;
+	bump_alloc(ctx, id, size);
+}
+
+// bytes in use, the most in use since the last compile, and bytes held in blocks, per arena_id
+__attribute__((export_name("get_arena_stats")))
+arena_stats *get_arena_stats(compiler_ctx *ctx) {
+	arena_stats *stats = ctx->memory.stats;
+	for (u32 i = 0; i < ARENA_COUNT; ++i) {
+		arena *a = ctx->memory.arenas + i;
+		u32 capacity = 0;
+		for (arena_block *block = a->block; block; block = block->next) {
+			capacity += block->size;
+		}
+
+		stats[i] = (arena_stats){ arena_used(a), a->peak, capacity };
+	}
+	return stats;
 }
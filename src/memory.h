@@ -1,4 +1,58 @@
 #pragma once
 #include "general.h"
 
-void *bump_alloc(u32 size);
+typedef enum arena_id arena_id;
+enum arena_id {
+	ARENA_SOURCE,    // the source text
+	ARENA_FRONT_END, // tokens, symbols and the parser's function and variable tables
+	ARENA_AST,       // nodes of the function being compiled, and other short-lived scratch
+	ARENA_OUTPUT,    // the module and its compile_result
+	ARENA_PREVIOUS_OUTPUT, // the last module, kept while a recompile copies unchanged functions out of it
+	ARENA_COUNT
+};
+
+typedef struct arena_block arena_block;
+
+typedef struct arena_checkpoint arena_checkpoint;
+struct arena_checkpoint {
+	arena_block *block;
+	u8 *ptr;
+};
+
+typedef struct arena_stats arena_stats;
+struct arena_stats {
+	u32 used;
+	u32 peak;
+	u32 capacity;
+};
+
+typedef struct arena arena;
+struct arena {
+	arena_block *block;
+	u8 *ptr;
+	u8 *end;
+	u32 reserved;
+	u32 peak;
+	arena_checkpoint mark;
+};
+
+// A context's arenas and the blocks it released. Blocks come from the heap
+// shared by every context and are only ever reused by the one that took them.
+typedef struct memory_state memory_state;
+struct memory_state {
+	arena arenas[ARENA_COUNT];
+	arena_block *free_blocks;
+	arena_stats stats[ARENA_COUNT];
+};
+
+void *heap_alloc(u32 size);
+void *bump_alloc(compiler_ctx *ctx, arena_id id, u32 size);
+void bump_set_mark(compiler_ctx *ctx);
+void bump_rewind(compiler_ctx *ctx);
+arena_checkpoint bump_checkpoint(compiler_ctx *ctx, arena_id id);
+void bump_restore(compiler_ctx *ctx, arena_id id, arena_checkpoint checkpoint);
+void bump_reset(compiler_ctx *ctx, arena_id id);
+void bump_swap(compiler_ctx *ctx, arena_id a, arena_id b);
+bool bump_empty(compiler_ctx *ctx, arena_id id);
+void *bump_reserve(compiler_ctx *ctx, arena_id id, u32 size);
+void bump_commit(compiler_ctx *ctx, arena_id id, u32 size);
@@ -0,0 +1,302 @@
+#include "compiler.h"
+
+// Constant propagation over one function's nodes, in the order they run.
+// At every point each local's slot either holds a known constant or not.
+// Reads of known slots become NODE_INT, and whatever then has only constant
+// operands is folded. The two sides of an if are followed separately and
+// merged. A loop forgets every slot assigned anywhere in it before its first
+// condition, and again after it ends. A store through a pointer or a call to a
+// function that isn't pure can write any slot, so after one nothing is known.
+typedef struct known_slot known_slot;
+struct known_slot {
+	bool known;
+	i32 value;
+};
+
+typedef struct propagation propagation;
+struct propagation {
+	compiler_ctx *ctx;
+	node *nodes;
+	u32 arg_count;
+	u32 slot_count;
+	known_slot *slots;
+	bool unreachable; // a return ran on every path to here
+};
+
+static known_slot *find_slot(propagation *p, u32 addr) {
+	u32 slot = (u32)((i32)addr / 4 + (i32)p->arg_count);
+	return (slot < p->slot_count) ? p->slots + slot : 0;
+}
+
+static void set_slot(propagation *p, u32 addr, node *value) {
+	known_slot *slot = find_slot(p, addr);
+	if (slot) *slot = (known_slot){ value->type == NODE_INT, value->value };
+}
+
+static void forget_all(propagation *p) {
+	for (u32 i = 0; i < p->slot_count; ++i) p->slots[i].known = false;
+}
+
+static void forget_assigned(propagation *p, u32 index);
+
+static void forget_assigned_list(propagation *p, u32 index) {
+	for (; index; index = p->nodes[index].next) forget_assigned(p, index);
+}
+
+static void forget_assigned(propagation *p, u32 index) {
+	if (!index) return;
+	node *n = p->nodes + index;
+	node_extra *extra = extra_of(n);
+
+	switch (n->type) {
+		case NODE_INT:
+		case NODE_VAR:
+			return;
+		case NODE_INT_DECL: {
+			known_slot *slot = find_slot(p, n->var.addr);
+			if (slot) slot->known = false;
+			forget_assigned(p, n->right);
+			return;
+		}
+		case NODE_ASSIGN: {
+			node *target = p->nodes + n->left;
+			if (target->type != NODE_VAR) forget_all(p);
+			known_slot *slot = (target->type == NODE_VAR) ? find_slot(p, target->var.addr) : 0;
+			if (slot) slot->known = false;
+			forget_assigned(p, n->left);
+			forget_assigned(p, n->right);
+			return;
+		}
+		case NODE_FUNC_CALL:
+			if (!p->ctx->parser.functions[extra->func_call.index].pure) forget_all(p);
+			forget_assigned_list(p, extra->func_call.args);
+			return;
+		case NODE_IF:
+			forget_assigned(p, extra->if_stmt.cond);
+			forget_assigned_list(p, extra->if_stmt.body);
+			forget_assigned_list(p, extra->if_stmt.else_stmt);
+			return;
+		case NODE_LOOP:
+		case NODE_DO_WHILE:
+			forget_assigned(p, extra->loop_stmt.start);
+			forget_assigned(p, extra->loop_stmt.condition);
+			forget_assigned_list(p, extra->loop_stmt.body);
+			forget_assigned_list(p, extra->loop_stmt.iteration);
+			return;
+		case NODE_NEGATE:
+		case NODE_DEREF:
+		case NODE_ADDRESS:
+		case NODE_RETURN:
+			forget_assigned(p, n->right);
+			return;
+		default:
+			forget_assigned(p, n->left);
+			forget_assigned(p, n->right);
+			return;
+	}
+}
+
+// everything but the start, which runs once before the loop
+static void forget_assigned_in_loop(propagation *p, node_extra *extra) {
+	forget_assigned(p, extra->loop_stmt.condition);
+	forget_assigned_list(p, extra->loop_stmt.body);
+	forget_assigned_list(p, extra->loop_stmt.iteration);
+}
+
+static void propagate_expr(propagation *p, u32 index) {
+	if (!index) return;
+	node *n = p->nodes + index;
+
+	switch (n->type) {
+		case NODE_INT:
+			return;
+
+		case NODE_VAR: {
+			known_slot *slot = find_slot(p, n->var.addr);
+			if (slot && slot->known) {
+				n->type = NODE_INT;
+				n->value = slot->value;
+			}
+			return;
+		}
+
+		case NODE_FUNC_CALL: {
+			node_extra *extra = extra_of(n);
+			for (u32 arg = extra->func_call.args; arg; arg = p->nodes[arg].next) {
+				propagate_expr(p, arg);
+			}
+
+			func *callee = p->ctx->parser.functions + extra->func_call.index;
+			if (!callee->pure) forget_all(p);
+
+			// arguments that became constant can make the call evaluable
+			i32 value = 0;
+			if (evaluate_call(p->ctx, callee, extra->func_call.args, &value)) {
+				n->type = NODE_INT;
+				n->value = value;
+			}
+			return;
+		}
+
+		case NODE_NEGATE:
+			propagate_expr(p, n->right);
+			if (p->nodes[n->right].type == NODE_INT) {
+				n->type = NODE_INT;
+				n->value = (u32)p->nodes[n->right].value * (u32)-1;
+			}
+			return;
+
+		case NODE_DEREF:
+		case NODE_RETURN:
+			propagate_expr(p, n->right);
+			return;
+
+		// takes where its operand is, not its value
+		case NODE_ADDRESS:
+			if (p->nodes[n->right].type != NODE_VAR) propagate_expr(p, n->right);
+			return;
+
+		case NODE_ASSIGN: {
+			node *target = p->nodes + n->left;
+			if (target->type != NODE_VAR) propagate_expr(p, n->left);
+			propagate_expr(p, n->right);
+			if (target->type == NODE_VAR) set_slot(p, target->var.addr, p->nodes + n->right);
+			else forget_all(p);
+			return;
+		}
+
+		case NODE_INT_DECL: {
+			// the initializer sees the slot as whatever was in it before
+			known_slot *slot = find_slot(p, n->var.addr);
+			if (slot) slot->known = false;
+			propagate_expr(p, n->right);
+			set_slot(p, n->var.addr, p->nodes + n->right);
+			return;
+		}
+	}
+
+	if (n->type < NODE_PLUS || n->type > NODE_LE) return;
+	propagate_expr(p, n->left);
+	propagate_expr(p, n->right);
+
+	node *left = p->nodes + n->left;
+	node *right = p->nodes + n->right;
+	i32 value = 0;
+	if (left->type == NODE_INT && right->type == NODE_INT && fold_binary(n->type, left->value, right->value, &value)) {
+		n->type = NODE_INT;
+		n->value = value;
+	}
+}
+
+static known_slot *save_slots(propagation *p) {
+	known_slot *saved = bump_alloc(p->ctx, ARENA_FRONT_END, sizeof(known_slot) * p->slot_count);
+	__builtin_memcpy(saved, p->slots, sizeof(known_slot) * p->slot_count);
+	return saved;
+}
+
+static void propagate_list(propagation *p, u32 *head);
+
+// An if whose condition is constant is replaced by the statements of the
+// branch that runs. It still has to leave a 0 when it ends its block, so the
+// if's own node becomes that 0.
+static void replace_constant_if(propagation *p, u32 *link) {
+	node *n = p->nodes + *link;
+	node_extra *extra = extra_of(n);
+	u32 branch = (p->nodes[extra->if_stmt.cond].value) ? extra->if_stmt.body : extra->if_stmt.else_stmt;
+
+	if (n->next) {
+		if (!branch) {
+			*link = n->next;
+			return;
+		}
+	} else {
+		n->type = NODE_INT;
+		n->value = 0;
+		if (!branch) return;
+	}
+
+	u32 tail = branch;
+	while (p->nodes[tail].next) tail = p->nodes[tail].next;
+	p->nodes[tail].next = (n->type == NODE_INT) ? *link : n->next;
+	*link = branch;
+}
+
+static void propagate_if(propagation *p, node_extra *extra) {
+	arena_checkpoint checkpoint = bump_checkpoint(p->ctx, ARENA_FRONT_END);
+	known_slot *before = save_slots(p);
+	bool unreachable_before = p->unreachable;
+
+	propagate_list(p, &extra->if_stmt.body);
+	known_slot *after_body = save_slots(p);
+	bool body_unreachable = p->unreachable;
+
+	__builtin_memcpy(p->slots, before, sizeof(known_slot) * p->slot_count);
+	p->unreachable = unreachable_before;
+	propagate_list(p, &extra->if_stmt.else_stmt);
+
+	if (p->unreachable) {
+		__builtin_memcpy(p->slots, after_body, sizeof(known_slot) * p->slot_count);
+		p->unreachable = body_unreachable;
+	} else if (!body_unreachable) {
+		for (u32 i = 0; i < p->slot_count; ++i) {
+			known_slot *slot = p->slots + i;
+			if (!after_body[i].known || after_body[i].value != slot->value) slot->known = false;
+		}
+	}
+	bump_restore(p->ctx, ARENA_FRONT_END, checkpoint);
+}
+
+static void propagate_loop(propagation *p, node *n) {
+	node_extra *extra = extra_of(n);
+	bool unreachable_before = p->unreachable;
+	propagate_expr(p, extra->loop_stmt.start);
+	forget_assigned_in_loop(p, extra);
+
+	if (n->type == NODE_LOOP) {
+		propagate_expr(p, extra->loop_stmt.condition);
+		// a condition that's always true doesn't need checking
+		node *condition = p->nodes + extra->loop_stmt.condition;
+		if (extra->loop_stmt.condition && condition->type == NODE_INT && condition->value) {
+			extra->loop_stmt.condition = 0;
+		}
+	}
+	propagate_list(p, &extra->loop_stmt.body);
+	propagate_list(p, &extra->loop_stmt.iteration);
+	if (n->type == NODE_DO_WHILE) propagate_expr(p, extra->loop_stmt.condition);
+
+	forget_assigned_in_loop(p, extra);
+	p->unreachable = unreachable_before;
+}
+
+static void propagate_list(propagation *p, u32 *head) {
+	u32 *link = head;
+	while (*link) {
+		node *n = p->nodes + *link;
+
+		if (n->type == NODE_IF) {
+			node_extra *extra = extra_of(n);
+			propagate_expr(p, extra->if_stmt.cond);
+			if (p->nodes[extra->if_stmt.cond].type == NODE_INT) {
+				replace_constant_if(p, link);
+				continue;
+			}
+			propagate_if(p, extra);
+		} else if (n->type == NODE_LOOP || n->type == NODE_DO_WHILE) {
+			propagate_loop(p, n);
+		} else {
+			propagate_expr(p, *link);
+			if (n->type == NODE_RETURN) p->unreachable = true;
+		}
+		link = &p->nodes[*link].next;
+	}
+}
+
+void propagate_constants(compiler_ctx *ctx, func *f) {
+	arena_checkpoint checkpoint = bump_checkpoint(ctx, ARENA_FRONT_END);
+	propagation p = { ctx, f->nodes, f->arg_count, f->arg_count + f->locals.frame_size / 4 };
+	p.slots = bump_alloc(ctx, ARENA_FRONT_END, sizeof(known_slot) * p.slot_count);
+	__builtin_memset(p.slots, 0, sizeof(known_slot) * p.slot_count);
+
+	propagate_list(&p, &f->body);
+	bump_restore(ctx, ARENA_FRONT_END, checkpoint);
+}
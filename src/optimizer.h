@@ -0,0 +1,5 @@
+#pragma once
+#include "parser.h"
+
+// folds what's constant in a parsed function's nodes, before its code is generated
+void propagate_constants(compiler_ctx *ctx, func *f);
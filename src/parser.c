@@ -1,216 +1,320 @@
-#include "parser.h"
-#include "memory.h"
-#include "tokenizer.h"
+#include "compiler.h"
 
-bool error_occurred;
+static u32 hash_symbol(u32 symbol) {
+	u32 hash = symbol * 2654435769u;
+	return hash ^ (hash >> 16);
+}
 
-static func *current_function;
+static void symbol_map_init(compiler_ctx *ctx, symbol_map *map, u32 capacity) {
+	map->keys = bump_alloc(ctx, ARENA_FRONT_END, sizeof(u32) * capacity);
+	map->values = bump_alloc(ctx, ARENA_FRONT_END, sizeof(u32) * capacity);
+	__builtin_memset(map->keys, 0, sizeof(u32) * capacity);
+	map->mask = capacity - 1;
+	map->count = 0;
+}
 
-int string_compare(identifier a, identifier b) {
-	u32 n = max(a.length, b.length);
-	for (u32 i = 0; i < n; ++i) {
-		if (a.name[i] != b.name[i])
-			return (a.name[i] < b.name[i]) ? -1 : 1;
+static u32 symbol_map_find(symbol_map *map, u32 symbol) {
+	u32 slot = hash_symbol(symbol) & map->mask;
+	for (; map->keys[slot]; slot = (slot + 1) & map->mask) {
+		if (map->keys[slot] == symbol + 1) return map->values[slot];
 	}
-	return 0;
+	return SYMBOL_NOT_FOUND;
 }
 
-variable *add_variable(identifier identifier, u32 pointer_indirections) {
-
-	variable_node *var = bump_alloc(sizeof(variable_node));
-	var->variable.identifier = identifier;
-	var->variable.addr = current_function->locals.stack_pointer;
-	var->variable.pointer_indirections = pointer_indirections;
-	current_function->locals.stack_pointer += 4;
-
-	variable_node *current = current_function->locals.head;
-	variable_node *previous = 0;
-	u32 compare_result = 0;
-
-	while (current != 0) {
-		previous = current;
-
-		compare_result = string_compare(identifier, current->variable.identifier);
-		if (compare_result == 0) {
-			return 0;
-		}
-
-		if (compare_result == -1) {
-			current = current->left;
-		}
-
-		if (compare_result == 1) {
-			current = current->right;
+static bool symbol_map_insert(compiler_ctx *ctx, symbol_map *map, u32 symbol, u32 value) {
+	if ((map->count + 1) * 2 > map->mask + 1) {
+		symbol_map old = *map;
+		symbol_map_init(ctx, map, (old.mask + 1) * 2);
+		for (u32 i = 0; i <= old.mask; ++i) {
+			if (old.keys[i]) symbol_map_insert(ctx, map, old.keys[i] - 1, old.values[i]);
 		}
 	}
 
-	if (compare_result == -1) {
-		previous->left = var;
+	u32 slot = hash_symbol(symbol) & map->mask;
+	for (; map->keys[slot]; slot = (slot + 1) & map->mask) {
+		if (map->keys[slot] == symbol + 1) return false;
 	}
 
-	if (compare_result == 1) {
-		previous->right = var;
+	map->keys[slot] = symbol + 1;
+	map->values[slot] = value;
+	map->count += 1;
+	return true;
+}
+
+static void symbol_map_set(compiler_ctx *ctx, symbol_map *map, u32 symbol, u32 value) {
+	u32 slot = hash_symbol(symbol) & map->mask;
+	for (; map->keys[slot]; slot = (slot + 1) & map->mask) {
+		if (map->keys[slot] == symbol + 1) {
+			map->values[slot] = value;
+			return;
+		}
 	}
+	symbol_map_insert(ctx, map, symbol, value);
+}
 
-	if (compare_result == 0) {
-		current_function->locals.head = var;
+// a name can be declared again in an inner scope, not in the same one
+static variable *push_variable(compiler_ctx *ctx, variable_table *table, u32 symbol, i32 addr, u32 pointer_indirections) {
+	u32 shadowed = symbol_map_find(&table->map, symbol);
+	if (shadowed != SYMBOL_NOT_FOUND && table->variables[shadowed].depth == table->depth) {
+		return 0;
+	}
+	symbol_map_set(ctx, &table->map, symbol, table->count);
+
+	if (table->count == table->capacity) {
+		u32 capacity = max(table->capacity * 2, 8);
+		variable *variables = bump_alloc(ctx, ARENA_FRONT_END, sizeof(variable) * capacity);
+		__builtin_memcpy(variables, table->variables, sizeof(variable) * table->count);
+		table->variables = variables;
+		table->capacity = capacity;
 	}
 
-	return &var->variable;
-};
+	variable *var = table->variables + table->count;
+	table->count += 1;
+	var->symbol = symbol;
+	var->addr = addr;
+	var->pointer_indirections = pointer_indirections;
+	var->depth = table->depth;
+	var->shadowed = shadowed;
+	return var;
+}
 
-variable *find_variable(identifier identifier) {
+// The parameters and the function's outermost block share depth 0. Bodies of
+// if, loops and nested blocks each open a scope, a for loop's one starts at
+// its initializer.
+static void enter_scope(compiler_ctx *ctx) {
+	ctx->parser.current_function->locals.depth += 1;
+}
 
-	variable *arg = current_function->args;
-	for (u32 i = 0; i < current_function->arg_count; ++i) {
-		u32 compare_result = string_compare(identifier, arg[i].identifier);
-		if (!compare_result) {
-			return arg + i;
-		}
+static void leave_scope(compiler_ctx *ctx) {
+	variable_table *locals = &ctx->parser.current_function->locals;
+	while (locals->count && locals->variables[locals->count - 1].depth == locals->depth) {
+		locals->count -= 1;
+		variable *var = locals->variables + locals->count;
+		symbol_map_set(ctx, &locals->map, var->symbol, var->shadowed);
+		locals->stack_pointer = var->addr;
 	}
+	locals->depth -= 1;
+}
 
-	variable_node *current = current_function->locals.head;
+variable *add_variable(compiler_ctx *ctx, u32 symbol, u32 pointer_indirections) {
+	variable_table *locals = &ctx->parser.current_function->locals;
+	variable *var = push_variable(ctx, locals, symbol, locals->stack_pointer, pointer_indirections);
+	if (var) locals->stack_pointer += 4;
+	locals->frame_size = max(locals->frame_size, locals->stack_pointer);
+	return var;
+}
 
-	while (current != 0) {
-		u32 compare_result = string_compare(identifier, current->variable.identifier);
+variable *add_param(compiler_ctx *ctx, u32 symbol, u32 pointer_indirections) {
+	func *f = ctx->parser.current_function;
+	variable *param = push_variable(ctx, &f->locals, symbol, (f->arg_count + 1) * -4, pointer_indirections);
+	if (param) f->arg_count += 1;
+	return param;
+}
 
-		if (compare_result == 0) {
-			return &current->variable;
-		}
+variable *find_variable(compiler_ctx *ctx, u32 symbol) {
+	variable_table *locals = &ctx->parser.current_function->locals;
+	u32 index = symbol_map_find(&locals->map, symbol);
+	return (index != SYMBOL_NOT_FOUND) ? locals->variables + index : 0;
+}
 
-		if (compare_result == -1) {
-			current = current->left;
-		}
+func *add_function(compiler_ctx *ctx, u32 symbol) {
+	if (!symbol_map_insert(ctx, &ctx->parser.function_map, symbol, ctx->parser.function_count)) {
+		return 0;
+	}
 
-		if (compare_result == 1) {
-			current = current->right;
-		}
+	if (ctx->parser.function_count == ctx->parser.function_capacity) {
+		ctx->parser.function_capacity *= 2;
+		func *new_functions = bump_alloc(ctx, ARENA_FRONT_END, sizeof(func) * ctx->parser.function_capacity);
+		__builtin_memcpy(new_functions, ctx->parser.functions, sizeof(func) * ctx->parser.function_count);
+		ctx->parser.functions = new_functions;
 	}
 
-	return 0;
+	func *new_function = ctx->parser.functions + ctx->parser.function_count;
+	*new_function = (func){0};
+	new_function->symbol = symbol;
+	new_function->func_idx = ctx->parser.function_count;
+	symbol_map_init(ctx, &new_function->locals.map, 16);
+	ctx->parser.function_count += 1;
+
+	return new_function;
 }
 
-static func *function_bst;
-static u32 global_function_count;
+// Only functions declared up to the current one can be called. The map can
+// hold later ones too when every signature was parsed before the bodies.
+func *find_function(compiler_ctx *ctx, u32 symbol) {
+	u32 index = symbol_map_find(&ctx->parser.function_map, symbol);
+	if (index == SYMBOL_NOT_FOUND || index > ctx->parser.current_function->func_idx) return 0;
+	return ctx->parser.functions + index;
+}
 
-func *add_function(identifier identifier) {
-	func *new_function = bump_alloc(sizeof(func));
-	new_function->identifier = identifier;
-	new_function->func_idx = global_function_count;
-	global_function_count += 1;
+static inline node *node_at(compiler_ctx *ctx, u32 index) {
+	return ctx->parser.nodes + index;
+}
 
-	func *current = function_bst;
-	func *previous = 0;
-	u32 compare_result = 0;
+static u32 reserve_nodes(compiler_ctx *ctx, u32 count) {
+	if (ctx->parser.node_count + count > ctx->parser.node_capacity) {
+		ctx->parser.node_capacity = max(ctx->parser.node_capacity * 2, ctx->parser.node_count + count);
+		ctx->parser.nodes = bump_reserve(ctx, ARENA_AST, sizeof(node) * ctx->parser.node_capacity);
+	}
 
-	while (current != 0) {
-		previous = current;
+	u32 index = ctx->parser.node_count;
+	ctx->parser.node_count += count;
+	__builtin_memset(ctx->parser.nodes + index, 0, sizeof(node) * count);
+	return index;
+}
 
-		compare_result = string_compare(identifier, current->identifier);
-		if (compare_result == 0) {
-			return 0;
-		}
+static u32 allocate_node(compiler_ctx *ctx) {
+	if (!ctx->parser.free_node_stack) return reserve_nodes(ctx, 1);
 
-		if (compare_result == -1) {
-			current = current->left;
-		}
+	u32 index = ctx->parser.free_node_stack;
+	ctx->parser.free_node_stack = ctx->parser.nodes[index].next;
+	ctx->parser.nodes[index] = (node){0};
+	return index;
+}
 
-		if (compare_result == 1) {
-			current = current->right;
-		}
-	}
+// if, loops and calls keep their extra children in the slot after them
+static u32 allocate_wide_node(compiler_ctx *ctx) {
+	return reserve_nodes(ctx, 2);
+}
 
-	if (compare_result == -1) {
-		previous->left = new_function;
-	}
+static void free_node(compiler_ctx *ctx, u32 index) {
+	ctx->parser.nodes[index].next = ctx->parser.free_node_stack;
+	ctx->parser.free_node_stack = index;
+}
 
-	if (compare_result == 1) {
-		previous->right = new_function;
-	}
+static func *function_signature(compiler_ctx *ctx);
+u32 expr_stmt(compiler_ctx *ctx);
+u32 expr(compiler_ctx *ctx);
+u32 decl(compiler_ctx *ctx);
+u32 primary(compiler_ctx *ctx);
+u32 code_block(compiler_ctx *ctx);
+u32 code_block_or_expr_stmt(compiler_ctx *ctx);
+void expect_token(compiler_ctx *ctx, token_type c);
+
+void parse_begin(compiler_ctx *ctx) {
+	ctx->parser.error_occurred = false;
+	ctx->parser.function_capacity = 16;
+	ctx->parser.functions = bump_alloc(ctx, ARENA_FRONT_END, sizeof(func) * ctx->parser.function_capacity);
+	ctx->parser.function_count = 0;
+	symbol_map_init(ctx, &ctx->parser.function_map, 32);
+}
 
-	if (compare_result == 0) {
-		function_bst = new_function;
+// A body's code only depends on its tokens, the parameters, and the index and
+// arity of the functions it calls, so equal hashes mean equal code.
+static u64 hash_mix(u64 hash, u64 value) {
+	return (hash ^ value) * 0x100000001B3ull;
+}
+
+// A * that doesn't follow an operand is a dereference, and pure functions
+// don't have any. Calling a pure function folds its body into the caller's
+// code, so the callee's hash becomes part of the caller's.
+static void hash_body(compiler_ctx *ctx, func *f) {
+	u64 hash = 0xCBF29CE484222325ull;
+	bool pure = true;
+	bool uses_addresses = false;
+	for (u32 i = 0; i < f->locals.count; ++i) {
+		hash = hash_mix(hash, f->locals.variables[i].symbol);
+		hash = hash_mix(hash, f->locals.variables[i].pointer_indirections);
 	}
 
-	return new_function;
-}
+	f->hash = 0;
+	f->body_tokens = 0;
+	f->pure = false;
+	f->uses_addresses = true;
+	if (peek(ctx, 0) != '{') return;
 
-func *find_function(identifier identifier) {
-	func *current = function_bst;
+	u32 depth = 0;
+	for (u32 n = 0;; ++n) {
+		token_type t = peek(ctx, n);
+		if (!t) return;
 
-	while (current != 0) {
-		u32 compare_result = string_compare(identifier, current->identifier);
+		hash = hash_mix(hash, t);
+		if (t == TOKEN_INT || t == TOKEN_IDENTIFIER) {
+			hash = hash_mix(hash, peek_value(ctx, n));
+		}
 
-		if (compare_result == 0) {
-			return current;
+		if (t == TOKEN_IDENTIFIER && peek(ctx, n + 1) == '(') {
+			func *callee = find_function(ctx, peek_value(ctx, n));
+			hash = hash_mix(hash, (callee) ? callee->func_idx : 0xFFFFFFFF);
+			hash = hash_mix(hash, (callee) ? callee->arg_count : 0);
+			if (callee != f) {
+				if (callee && callee->pure) hash = hash_mix(hash, callee->hash);
+				else pure = false;
+			}
 		}
 
-		if (compare_result == -1) {
-			current = current->left;
+		token_type prev = peek(ctx, n - 1);
+		if (t == '&' || (t == '*' && prev != TOKEN_INT && prev != TOKEN_IDENTIFIER && prev != ')')) {
+			pure = false;
+			uses_addresses = true;
 		}
 
-		if (compare_result == 1) {
-			current = current->right;
+		if (t == '{') ++depth;
+		if (t == '}' && --depth == 0) {
+			f->hash = max(hash, 1);
+			f->body_tokens = n + 1;
+			f->pure = pure;
+			f->uses_addresses = uses_addresses;
+			return;
 		}
 	}
-
-	return 0;
 }
 
-static node *free_node_stack = 0;
+func *parse_signature(compiler_ctx *ctx) {
+	if (!peek(ctx, 0) || ctx->parser.error_occurred) return 0;
 
-static node *allocate_node() {
-	if (free_node_stack == 0)
-		return bump_alloc(sizeof(node));
+	func *function = function_signature(ctx);
+	if (ctx->parser.error_occurred) return 0;
 
-	node *new_node = free_node_stack;
-	free_node_stack = free_node_stack->next;
-	return new_node;
+	function->body_start = token_position(ctx);
+	hash_body(ctx, function);
+	return function;
 }
 
-static void free_node(node *n) {
-	*n = (node){0};
-	if (!free_node_stack) {
-		free_node_stack = n;
-		return;
+// The nodes of the previous function are gone once the caller resets the AST
+// arena, so every function starts a new node array.
+bool parse_body(compiler_ctx *ctx) {
+	ctx->parser.node_capacity = 256;
+	ctx->parser.nodes = bump_reserve(ctx, ARENA_AST, sizeof(node) * ctx->parser.node_capacity);
+	ctx->parser.nodes[0] = (node){0};
+	ctx->parser.node_count = 1;
+	ctx->parser.free_node_stack = 0;
+
+	func *f = ctx->parser.current_function;
+	f->body = code_block(ctx);
+	f->nodes = ctx->parser.nodes;
+	if (ctx->parser.error_occurred) return false;
+
+	propagate_constants(ctx, f);
+	if (f->pure) {
+		f->pure_nodes = bump_alloc(ctx, ARENA_FRONT_END, sizeof(node) * ctx->parser.node_count);
+		__builtin_memcpy(f->pure_nodes, ctx->parser.nodes, sizeof(node) * ctx->parser.node_count);
 	}
-
-	n->next = free_node_stack;
-	free_node_stack = n;
+	return true;
 }
 
-void function_decl();
-node *expr_stmt();
-node *expr();
-node *decl();
-node *primary();
-node *code_block();
-node *code_block_or_expr_stmt();
-node *code_block_or_expr_stmt();
-void expect_token(token_type c);
-
-func *parse_tokens(u32 *function_count) {
-	error_occurred = false;
-	function_bst = 0;
-	global_function_count = 0;
-	free_node_stack = 0;
+void skip_body(compiler_ctx *ctx) {
+	advance_tokens(ctx, ctx->parser.current_function->body_tokens);
+}
 
-	while (current_token().type && !error_occurred) {
-		function_decl();
-	}
+void seek_body(compiler_ctx *ctx, func *f) {
+	ctx->parser.current_function = f;
+	seek_token(ctx, f->body_start);
+}
 
-	*function_count = global_function_count;
+func *parsed_functions(compiler_ctx *ctx, u32 *function_count) {
+	*function_count = ctx->parser.function_count;
 
-	return (error_occurred) ? 0 : function_bst;
+	return (ctx->parser.error_occurred || !ctx->parser.function_count) ? 0 : ctx->parser.functions;
 }
 
-void expect_token(token_type t) {
-	if (current_token().type == t) {
-		advance_token();
+void expect_token(compiler_ctx *ctx, token_type t) {
+	if (peek(ctx, 0) == t) {
+		advance_token(ctx);
 		return;
 	}
 
-	if (!error_occurred) {
+	if (!ctx->parser.error_occurred) {
 		const char *value = 0;
 		switch (t) {
 			case TOKEN_INT: value = "an integer"; break;
@@ -224,260 +328,265 @@ void expect_token(token_type t) {
 				break;
 			}
 		}
-		set_error_msg("Expected %s on line %l", value);
+		set_error_msg(ctx, "Expected %s on line %l", value);
 	}
-	error_occurred = true;
+	ctx->parser.error_occurred = true;
 }
 
-void function_decl() {
-	expect_token(TOKEN_INT_DECL);
-	if (current_token().type != TOKEN_IDENTIFIER) {
-		error_occurred = true;
-		expected_identifier(IDENTIFIER_FUNC);
-		return;
+// parses `int name(params)` and makes the function current
+static func *function_signature(compiler_ctx *ctx) {
+	expect_token(ctx, TOKEN_INT_DECL);
+	if (peek(ctx, 0) != TOKEN_IDENTIFIER) {
+		ctx->parser.error_occurred = true;
+		expected_identifier(ctx, IDENTIFIER_FUNC);
+		return 0;
 	}
-	func *function = add_function(current_token().identifier);
+	func *function = add_function(ctx, peek_value(ctx, 0));
 	if (!function) {
-		error_occurred = true;
-		redeclaration_error(IDENTIFIER_FUNC);
-		return;
+		ctx->parser.error_occurred = true;
+		redeclaration_error(ctx, IDENTIFIER_FUNC, peek_value(ctx, 0));
+		return 0;
 	}
 
-	advance_token();
+	advance_token(ctx);
 
-	expect_token('(');
+	expect_token(ctx, '(');
 
-	function->locals.stack_pointer = 0;
-	function->arg_count = 0;
-	if (current_token().type == TOKEN_INT_DECL) {
-		advance_token();
-
-		u32 pointer_indirections = 0;
-		while (current_token().type == '*') {
-			pointer_indirections += 1;
-			advance_token();
-		}
-
-		if (current_token().type != TOKEN_IDENTIFIER) {
-			error_occurred = true;
-			expected_identifier(IDENTIFIER_PARAM);
-			return;
-		}
-		function->arg_count = 1;
-		variable *args = bump_alloc(0);
-		args[0].identifier = current_token().identifier;
-		args[0].addr = function->arg_count * -4;
-		args[0].pointer_indirections = 0;
-		advance_token();
-
-		while (current_token().type == ',') {
-			advance_token();
-			expect_token(TOKEN_INT_DECL);
+	ctx->parser.current_function = function;
+	if (peek(ctx, 0) == TOKEN_INT_DECL) {
+		while (true) {
+			expect_token(ctx, TOKEN_INT_DECL);
 
 			u32 pointer_indirections = 0;
-			while (current_token().type == '*') {
+			while (peek(ctx, 0) == '*') {
 				pointer_indirections += 1;
-				advance_token();
+				advance_token(ctx);
+			}
+
+			if (peek(ctx, 0) != TOKEN_IDENTIFIER) {
+				ctx->parser.error_occurred = true;
+				expected_identifier(ctx, IDENTIFIER_PARAM);
+				return 0;
 			}
 
-			if (current_token().type != TOKEN_IDENTIFIER) {
-				error_occurred = true;
-				expected_identifier(IDENTIFIER_PARAM);
-				return;
+			if (!add_param(ctx, peek_value(ctx, 0), pointer_indirections)) {
+				ctx->parser.error_occurred = true;
+				redeclaration_error(ctx, IDENTIFIER_PARAM, peek_value(ctx, 0));
+				return 0;
 			}
+			advance_token(ctx);
 
-			variable *arg = args + function->arg_count;
-			function->arg_count += 1;
-			arg->identifier = current_token().identifier;
-			arg->addr = function->arg_count * -4;
-			arg->pointer_indirections = pointer_indirections;
-			advance_token();
+			if (peek(ctx, 0) != ',') break;
+			advance_token(ctx);
 		}
-		function->args = args;
-		bump_alloc(sizeof(variable) * function->arg_count);
 	}
 
-	expect_token(')');
-
-	current_function = function;
-	function->body = code_block();
-	return;
+	expect_token(ctx, ')');
+	return function;
 }
 
-node *code_block() {
+u32 code_block(compiler_ctx *ctx) {
 
 	u32 depth = 1;
-	expect_token('{');
+	expect_token(ctx, '{');
 
-	node head = {0};
-	node *current = &head;
+	u32 head = 0;
+	u32 current = 0;
 
-	while (depth > 0 && !error_occurred && current_token().type != 0) {
-		while (current_token().type == '{') {
+	while (depth > 0 && !ctx->parser.error_occurred && peek(ctx, 0) != 0) {
+		while (peek(ctx, 0) == '{') {
 			++depth;
-			advance_token();
+			enter_scope(ctx);
+			advance_token(ctx);
 		}
 
-		current->next = expr_stmt();
-		if (current->next != 0)
-			current = current->next;
+		u32 statement = expr_stmt(ctx);
+		if (statement) {
+			if (current) node_at(ctx, current)->next = statement;
+			else head = statement;
+			current = statement;
+		}
 
-		while (current_token().type == '}' && depth > 0) {
+		while (peek(ctx, 0) == '}' && depth > 0) {
 			--depth;
-			advance_token();
+			if (depth) leave_scope(ctx);
+			advance_token(ctx);
 		}
 	}
 
-	if (depth != 0 && !error_occurred) {
-		set_error_msg("Bracket mismatch on line %l");
-		error_occurred = true;
+	if (depth != 0 && !ctx->parser.error_occurred) {
+		set_error_msg(ctx, "Bracket mismatch on line %l");
+		ctx->parser.error_occurred = true;
 		return 0;
 	}
 
-	current->next = 0;
+	if (current) node_at(ctx, current)->next = 0;
 
-	return head.next;
+	return head;
 }
 
-node *code_block_or_expr_stmt() {
-	if (current_token().type == '{') {
-		return code_block();
-	}
-	return expr_stmt();
+// the body of an if or a loop, in its own scope
+u32 code_block_or_expr_stmt(compiler_ctx *ctx) {
+	enter_scope(ctx);
+	u32 body = (peek(ctx, 0) == '{') ? code_block(ctx) : expr_stmt(ctx);
+	leave_scope(ctx);
+	return body;
 }
 
-node *decl() {
-	if (current_token().type == TOKEN_INT_DECL) {
-		advance_token();
+u32 decl(compiler_ctx *ctx) {
+	if (peek(ctx, 0) == TOKEN_INT_DECL) {
+		advance_token(ctx);
 
 		u32 pointer_indirections = 0;
-		while (current_token().type == '*') {
+		while (peek(ctx, 0) == '*') {
 			pointer_indirections += 1;
-			advance_token();
+			advance_token(ctx);
 		}
 
-		if (current_token().type != TOKEN_IDENTIFIER) {
-			error_occurred = true;
-			expected_identifier(IDENTIFIER_VAR);
+		if (peek(ctx, 0) != TOKEN_IDENTIFIER) {
+			ctx->parser.error_occurred = true;
+			expected_identifier(ctx, IDENTIFIER_VAR);
 			return 0;
 		}
 
-		variable *var = add_variable(current_token().identifier, pointer_indirections);
+		variable *var = add_variable(ctx, peek_value(ctx, 0), pointer_indirections);
 		if (!var) {
-			error_occurred = true;
-			redeclaration_error(IDENTIFIER_VAR);
+			ctx->parser.error_occurred = true;
+			redeclaration_error(ctx, IDENTIFIER_VAR, peek_value(ctx, 0));
 			return 0;
 		}
-		advance_token();
+		advance_token(ctx);
 
-		expect_token('=');
+		expect_token(ctx, '=');
 
-		node *declaration = allocate_node();
-		declaration->type = NODE_INT_DECL;
-		declaration->var.addr = var->addr;
-		declaration->var.pointer_indirections = pointer_indirections;
-		declaration->right = expr();
+		u32 declaration = allocate_node(ctx);
+		node_at(ctx, declaration)->type = NODE_INT_DECL;
+		node_at(ctx, declaration)->var.addr = var->addr;
+		u32 value = expr(ctx);
+		node_at(ctx, declaration)->right = value;
 
 		return declaration;
 	}
 
-	error_occurred = true;
+	ctx->parser.error_occurred = true;
 	return 0;
 }
 
-node *expr_stmt() {
+u32 expr_stmt(compiler_ctx *ctx) {
 
-	if (current_token().type == TOKEN_INT_DECL) {
-		node *declaration = decl();
-		expect_token(';');
+	if (peek(ctx, 0) == TOKEN_INT_DECL) {
+		u32 declaration = decl(ctx);
+		expect_token(ctx, ';');
 		return declaration;
 	}
 
-	if (current_token().type == TOKEN_IF) {
-		advance_token();
+	if (peek(ctx, 0) == TOKEN_IF) {
+		advance_token(ctx);
 
-		node *if_stmt = allocate_node();
-		if_stmt->type = NODE_IF;
-		expect_token('(');
-		if_stmt->if_stmt.cond = expr();
-		expect_token(')');
-		if_stmt->if_stmt.body = code_block_or_expr_stmt();
+		u32 if_stmt = allocate_wide_node(ctx);
+		node_at(ctx, if_stmt)->type = NODE_IF;
+		expect_token(ctx, '(');
+		u32 cond = expr(ctx);
+		expect_token(ctx, ')');
+		u32 body = code_block_or_expr_stmt(ctx);
+		u32 else_stmt = 0;
 
-		if (current_token().type == TOKEN_ELSE) {
-			advance_token();
-			if_stmt->if_stmt.else_stmt = code_block_or_expr_stmt();
+		if (peek(ctx, 0) == TOKEN_ELSE) {
+			advance_token(ctx);
+			else_stmt = code_block_or_expr_stmt(ctx);
 		}
 
+		node_extra *extra = extra_of(node_at(ctx, if_stmt));
+		extra->if_stmt.cond = cond;
+		extra->if_stmt.body = body;
+		extra->if_stmt.else_stmt = else_stmt;
 		return if_stmt;
 	}
 
-	if (current_token().type == TOKEN_FOR) {
-		advance_token();
-		node *for_loop = allocate_node();
-		for_loop->type = NODE_LOOP;
-
-		expect_token('(');
-		if (current_token().type != ';')
-			for_loop->loop_stmt.start = (current_token().type == TOKEN_INT_DECL) ? decl() : expr();
-		expect_token(';');
-		if (current_token().type != ';')
-			for_loop->loop_stmt.condition = expr();
-		expect_token(';');
-		if (current_token().type != ')')
-			for_loop->loop_stmt.iteration = expr();
-		expect_token(')');
-
-		for_loop->loop_stmt.body = code_block_or_expr_stmt();
+	if (peek(ctx, 0) == TOKEN_FOR) {
+		advance_token(ctx);
+		u32 for_loop = allocate_wide_node(ctx);
+		node_at(ctx, for_loop)->type = NODE_LOOP;
+		u32 start = 0, condition = 0, iteration = 0;
+
+		enter_scope(ctx);
+		expect_token(ctx, '(');
+		if (peek(ctx, 0) != ';')
+			start = (peek(ctx, 0) == TOKEN_INT_DECL) ? decl(ctx) : expr(ctx);
+		expect_token(ctx, ';');
+		if (peek(ctx, 0) != ';')
+			condition = expr(ctx);
+		expect_token(ctx, ';');
+		if (peek(ctx, 0) != ')')
+			iteration = expr(ctx);
+		expect_token(ctx, ')');
+
+		u32 body = code_block_or_expr_stmt(ctx);
+		leave_scope(ctx);
+
+		node_extra *extra = extra_of(node_at(ctx, for_loop));
+		extra->loop_stmt.start = start;
+		extra->loop_stmt.condition = condition;
+		extra->loop_stmt.iteration = iteration;
+		extra->loop_stmt.body = body;
 		return for_loop;
 	}
 
-	if (current_token().type == TOKEN_WHILE) {
-		advance_token();
-		node *while_loop = allocate_node();
-		while_loop->type = NODE_LOOP;
+	if (peek(ctx, 0) == TOKEN_WHILE) {
+		advance_token(ctx);
+		u32 while_loop = allocate_wide_node(ctx);
+		node_at(ctx, while_loop)->type = NODE_LOOP;
+
+		expect_token(ctx, '(');
+		u32 condition = expr(ctx);
+		expect_token(ctx, ')');
 
-		expect_token('(');
-		while_loop->loop_stmt.condition = expr();
-		expect_token(')');
+		u32 body = code_block_or_expr_stmt(ctx);
 
-		while_loop->loop_stmt.body = code_block_or_expr_stmt();
+		node_extra *extra = extra_of(node_at(ctx, while_loop));
+		extra->loop_stmt.condition = condition;
+		extra->loop_stmt.body = body;
 		return while_loop;
 	}
 
-	if (current_token().type == TOKEN_DO) {
-		advance_token();
-		node *while_loop = allocate_node();
-		while_loop->type = NODE_DO_WHILE;
+	if (peek(ctx, 0) == TOKEN_DO) {
+		advance_token(ctx);
+		u32 while_loop = allocate_wide_node(ctx);
+		node_at(ctx, while_loop)->type = NODE_DO_WHILE;
 
-		while_loop->loop_stmt.body = code_block_or_expr_stmt();
+		u32 body = code_block_or_expr_stmt(ctx);
 
-		expect_token(TOKEN_WHILE);
-		expect_token('(');
-		while_loop->loop_stmt.condition = expr();
-		expect_token(')');
-		expect_token(';');
+		expect_token(ctx, TOKEN_WHILE);
+		expect_token(ctx, '(');
+		u32 condition = expr(ctx);
+		expect_token(ctx, ')');
+		expect_token(ctx, ';');
 
+		node_extra *extra = extra_of(node_at(ctx, while_loop));
+		extra->loop_stmt.condition = condition;
+		extra->loop_stmt.body = body;
 		return while_loop;
 	}
 
-	if (current_token().type == TOKEN_RETURN) {
-		advance_token();
+	if (peek(ctx, 0) == TOKEN_RETURN) {
+		advance_token(ctx);
 
-		node *return_node = allocate_node();
-		return_node->type = NODE_RETURN;
-		return_node->right = expr();
+		u32 return_node = allocate_node(ctx);
+		node_at(ctx, return_node)->type = NODE_RETURN;
+		u32 value = expr(ctx);
+		node_at(ctx, return_node)->right = value;
 
-		expect_token(';');
+		expect_token(ctx, ';');
 		return return_node;
 	}
 
-	if (current_token().type == ';') {
-		advance_token();
+	if (peek(ctx, 0) == ';') {
+		advance_token(ctx);
 		return 0;
 	}
 
-	node *n = expr();
-	expect_token(';');
+	u32 n = expr(ctx);
+	expect_token(ctx, ';');
 	return n;
 }
 
@@ -497,148 +606,230 @@ u32 get_precedence(node_type type) {
 	return PRECEDENCE_ADD;
 }
 
-node *unary() {
-	if (current_token().type == '-') {
-		advance_token();
-		node *primary_expr = primary();
-		if (primary_expr->type == NODE_INT) {
-			primary_expr->value *= -1;
+// whether the operator waiting for its right side gets it before next is
+// parsed, which is when next doesn't bind tighter, except that a = b = c
+// groups to the right
+static bool reduces_before(node_type waiting, node_type next) {
+	if (waiting == NODE_ASSIGN && next == NODE_ASSIGN) return false;
+	return get_precedence(next) <= get_precedence(waiting);
+}
+
+// the node a binary operator token becomes, 0 if the token isn't one
+static node_type binary_operator(token_type t) {
+	switch (t) {
+		case '+': 		return NODE_PLUS;
+		case '-': 		return NODE_MINUS;
+		case '*': 		return NODE_MULTIPLY;
+		case '/': 		return NODE_DIVIDE;
+		case TOKEN_EQ: 	return NODE_EQ;
+		case TOKEN_NE: 	return NODE_NE;
+		case '<': 		return NODE_LT;
+		case '>': 		return NODE_GT;
+		case TOKEN_LE: 	return NODE_LE;
+		case TOKEN_GE: 	return NODE_GE;
+		case '=': 		return NODE_ASSIGN;
+	}
+	return 0;
+}
+
+u32 unary(compiler_ctx *ctx) {
+	if (peek(ctx, 0) == '-') {
+		advance_token(ctx);
+		u32 primary_expr = primary(ctx);
+		if (node_at(ctx, primary_expr)->type == NODE_INT) {
+			node_at(ctx, primary_expr)->value *= -1;
 			return primary_expr;
 		}
 
-		node *unary_node = allocate_node();
-		unary_node->type = NODE_NEGATE;
-		unary_node->right = primary_expr;
+		u32 unary_node = allocate_node(ctx);
+		node_at(ctx, unary_node)->type = NODE_NEGATE;
+		node_at(ctx, unary_node)->right = primary_expr;
 
 		return unary_node;
 	}
 
-	if (current_token().type == '&' || current_token().type == '*') {
+	if (peek(ctx, 0) == '&' || peek(ctx, 0) == '*') {
 
-		node head = {0};
-		node *current = &head;
+		u32 head = 0;
+		u32 current = 0;
 
-		while (current_token().type == '*' || current_token().type == '&') {
-			token prev_token = current_token();
-			advance_token();
-			if (prev_token.type == '*' && current_token().type == '&') {
-				advance_token();
+		while (peek(ctx, 0) == '*' || peek(ctx, 0) == '&') {
+			token_type prev_type = peek(ctx, 0);
+			advance_token(ctx);
+			if (prev_type == '*' && peek(ctx, 0) == '&') {
+				advance_token(ctx);
 				continue;
 			}
-			current = current->right = allocate_node();
-			current->type = (prev_token.type == '&') ? NODE_ADDRESS : NODE_DEREF;
+			u32 child = allocate_node(ctx);
+			node_at(ctx, child)->type = (prev_type == '&') ? NODE_ADDRESS : NODE_DEREF;
+			if (current) node_at(ctx, current)->right = child;
+			else head = child;
+			current = child;
 		}
-		current->right = primary();
 
-		return head.right;
+		u32 operand = primary(ctx);
+		if (!current) return operand;
+
+		node_at(ctx, current)->right = operand;
+		return head;
 	}
 
-	return primary();
+	return primary(ctx);
 }
 
-node *primary() {
+u32 primary(compiler_ctx *ctx) {
 
-	if (current_token().type == '(') {
-		advance_token();
-		node *primary_node = expr();
-		expect_token(')');
+	if (peek(ctx, 0) == '(') {
+		advance_token(ctx);
+		u32 primary_node = expr(ctx);
+		expect_token(ctx, ')');
 		return primary_node;
 	}
 
-	if (current_token().type == TOKEN_IDENTIFIER) {
-		token identifier_token = current_token();
-		advance_token();
-		if (current_token().type != '(') {
-			variable *var = find_variable(identifier_token.identifier);
+	if (peek(ctx, 0) == TOKEN_IDENTIFIER) {
+		u32 symbol = peek_value(ctx, 0);
+		if (peek(ctx, 1) != '(') {
+			variable *var = find_variable(ctx, symbol);
 			if (!var) {
-				error_occurred = true;
-				not_found_error(IDENTIFIER_VAR);
+				ctx->parser.error_occurred = true;
+				not_found_error(ctx, IDENTIFIER_VAR, symbol);
 				return 0;
 			}
+			advance_token(ctx);
 
-			node *primary_node = allocate_node();
-			primary_node->type = NODE_VAR;
-			primary_node->var.addr = var->addr;
-			primary_node->var.pointer_indirections = var->pointer_indirections;
+			u32 primary_node = allocate_node(ctx);
+			node_at(ctx, primary_node)->type = NODE_VAR;
+			node_at(ctx, primary_node)->var.addr = var->addr;
+			node_at(ctx, primary_node)->var.pointer_indirections = var->pointer_indirections;
 			return primary_node;
 		} else {
-			func *f = find_function(identifier_token.identifier);
+			func *f = find_function(ctx, symbol);
 			if (!f) {
-				error_occurred = true;
-				not_found_error(IDENTIFIER_FUNC);
+				ctx->parser.error_occurred = true;
+				not_found_error(ctx, IDENTIFIER_FUNC, symbol);
 				return 0;
 			}
+			advance_token(ctx);
 
-			node *function_call = allocate_node();
-			function_call->type = NODE_FUNC_CALL;
-			function_call->func_call.stack_pointer = current_function->locals.stack_pointer;
-			function_call->func_call.index = f->func_idx;
+			u32 function_call = allocate_wide_node(ctx);
+			node_at(ctx, function_call)->type = NODE_FUNC_CALL;
+			u32 args = 0;
 
-			expect_token('(');
+			expect_token(ctx, '(');
 
 			if (f->arg_count) {
 				u32 arg_count = 1;
 
-				node *current = expr();
-				current->next = 0;
+				u32 current = expr(ctx);
+				if (ctx->parser.error_occurred) return 0;
+				node_at(ctx, current)->next = 0;
+				args = current;
 
-				function_call->func_call.args = current;
-
-				while (!error_occurred && current_token().type == ',') {
+				while (!ctx->parser.error_occurred && peek(ctx, 0) == ',') {
 					arg_count += 1;
-					advance_token();
-					current = expr();
-					current->next = function_call->func_call.args;
-					function_call->func_call.args = current;
+					advance_token(ctx);
+					u32 last = current;
+					current = expr(ctx);
+					if (ctx->parser.error_occurred) return 0;
+					node_at(ctx, current)->next = 0;
+					node_at(ctx, last)->next = current;
 				}
 
 				if (arg_count != f->arg_count) {
-					error_occurred = true;
-					set_error_msg("function %i called with incorrect number of arguments on line %l\nRequires %d arguments, but %d were given",
-							identifier_token.identifier,
+					ctx->parser.error_occurred = true;
+					set_error_msg(ctx, "function %i called with incorrect number of arguments on line %l\nRequires %d arguments, but %d were given",
+							symbol_name(ctx, symbol),
 							f->arg_count,
 							arg_count);
 					return 0;
 				}
 			}
 
-			expect_token(')');
+			expect_token(ctx, ')');
 
+			i32 value = 0;
+			if (!ctx->parser.error_occurred && evaluate_call(ctx, f, args, &value)) {
+				while (args) {
+					u32 next = node_at(ctx, args)->next;
+					free_node(ctx, args);
+					args = next;
+				}
+				node_at(ctx, function_call)->type = NODE_INT;
+				node_at(ctx, function_call)->value = value;
+				return function_call;
+			}
+
+			node_extra *extra = extra_of(node_at(ctx, function_call));
+			extra->func_call.index = f->func_idx;
+			extra->func_call.stack_pointer = ctx->parser.current_function->locals.stack_pointer;
+			extra->func_call.args = args;
 			return function_call;
 		}
 	}
 
-	if (current_token().type == TOKEN_INT) {
-		node *primary_node = allocate_node();
-		primary_node->type = NODE_INT;
-		primary_node->value = current_token().value;
-		advance_token();
+	if (peek(ctx, 0) == TOKEN_INT) {
+		u32 primary_node = allocate_node(ctx);
+		node_at(ctx, primary_node)->type = NODE_INT;
+		node_at(ctx, primary_node)->value = peek_value(ctx, 0);
+		advance_token(ctx);
 		return primary_node;
 	}
 
-	if (!error_occurred) {
-		set_error_msg("Invalid expression on line: %l");
-		error_occurred = true;
+	if (!ctx->parser.error_occurred) {
+		set_error_msg(ctx, "Invalid expression on line: %l");
+		ctx->parser.error_occurred = true;
 	}
 	return 0;
 }
 
-void simplify_node(node *n) {
+bool fold_binary(node_type type, i32 left, i32 right, i32 *value) {
+	switch (type) {
+		case NODE_PLUS:
+			*value = (u32)left + (u32)right; break;
+		case NODE_MINUS:
+			*value = (u32)left - (u32)right; break;
+		case NODE_MULTIPLY:
+			*value = (u32)left * (u32)right; break;
+		case NODE_DIVIDE:
+			if (right == 0 || (left == (i32)0x80000000 && right == -1)) return false;
+			*value = left / right; break;
+		case NODE_EQ:
+			*value = left == right; break;
+		case NODE_NE:
+			*value = left != right; break;
+		case NODE_GT:
+			*value = left > right; break;
+		case NODE_LT:
+			*value = left < right; break;
+		case NODE_GE:
+			*value = left >= right; break;
+		case NODE_LE:
+			*value = left <= right; break;
+		default:
+			return false;
+	}
+	return true;
+}
 
-	if (n->type == NODE_PLUS || n->type == NODE_MINUS) {
-		if (n->left->type == NODE_VAR && n->left->var.pointer_indirections || n->left->type == NODE_ADDRESS) {
-			node *mul = allocate_node();
-			mul->type = NODE_MULTIPLY;
+void simplify_node(compiler_ctx *ctx, u32 index) {
+	node *n = node_at(ctx, index);
 
-			if (n->right->type == NODE_INT) {
-				n->right->value *= 4;
+	if (n->type == NODE_PLUS || n->type == NODE_MINUS) {
+		node *left = node_at(ctx, n->left);
+		if (left->type == NODE_VAR && left->var.pointer_indirections || left->type == NODE_ADDRESS) {
+			if (node_at(ctx, n->right)->type == NODE_INT) {
+				node_at(ctx, n->right)->value *= 4;
 			} else {
-				node *ptr_multipler = allocate_node();
-				ptr_multipler->type = NODE_INT;
-				ptr_multipler->value = 4;
+				u32 mul = allocate_node(ctx);
+				u32 ptr_multipler = allocate_node(ctx);
+				n = node_at(ctx, index);
+
+				node_at(ctx, ptr_multipler)->type = NODE_INT;
+				node_at(ctx, ptr_multipler)->value = 4;
 
-				mul->left = n->right;
-				mul->right = ptr_multipler;
+				node_at(ctx, mul)->type = NODE_MULTIPLY;
+				node_at(ctx, mul)->left = n->right;
+				node_at(ctx, mul)->right = ptr_multipler;
 
 				n->right = mul;
 			}
@@ -646,150 +837,698 @@ void simplify_node(node *n) {
 	}
 
 	if (n->type >= NODE_PLUS && n->type <= NODE_LE) {
-		if (n->left->type == NODE_INT && n->right->type == NODE_INT) {
-			i32 new_value = 0;
-			switch (n->type) {
-				case NODE_PLUS:
-					new_value = n->left->value + n->right->value; break;
-				case NODE_MINUS:
-					new_value = n->left->value - n->right->value; break;
-				case NODE_MULTIPLY:
-					new_value = n->left->value * n->right->value; break;
-				case NODE_DIVIDE:
-					new_value = n->left->value / n->right->value; break;
-				case NODE_EQ:
-					new_value = n->left->value == n->right->value; break;
-				case NODE_NE:
-					new_value = n->left->value != n->right->value; break;
-				case NODE_GT:
-					new_value = n->left->value > n->right->value; break;
-				case NODE_LT:
-					new_value = n->left->value < n->right->value; break;
-				case NODE_GE:
-					new_value = n->left->value >= n->right->value; break;
-				case NODE_LE:
-					new_value = n->left->value <= n->right->value; break;
-			}
+		node *left = node_at(ctx, n->left);
+		node *right = node_at(ctx, n->right);
+		i32 new_value = 0;
+		if (left->type == NODE_INT && right->type == NODE_INT && fold_binary(n->type, left->value, right->value, &new_value)) {
+			free_node(ctx, n->left);
+			free_node(ctx, n->right);
 			n->type = NODE_INT;
-			free_node(n->left);
-			free_node(n->right);
 			n->value = new_value;
 		}
 	}
 }
 
-node *expr() {
-	node *primary_stack = 0;
-	node *op_stack = 0;
-	node *top_node = 0;
+// Calls to pure functions with constant arguments are run here on the
+// callee's kept nodes and replaced by their result. A frame holds the
+// parameters, the last one first, and then the locals, one slot per 4
+// bytes. Anything that would trap or take too long fails the evaluation
+// and the call stays.
+#define EVAL_STEP_BUDGET 100000
+#define EVAL_MAX_DEPTH 32
+
+typedef struct evaluation evaluation;
+struct evaluation {
+	compiler_ctx *ctx;
+	u32 steps;
+	u32 depth;
+	bool failed;
+	bool returning;
+	i32 return_value;
+};
 
-	top_node = unary();
-	if (!top_node) return 0;
+typedef struct eval_frame eval_frame;
+struct eval_frame {
+	node *nodes;
+	u32 arg_count;
+	u32 slot_count;
+	i32 *slots;
+	bool *defined; // a declaration can read itself before it's stored
+};
+
+static i32 eval_node(evaluation *e, eval_frame *frame, u32 index);
+static i32 eval_function(evaluation *e, func *f, i32 *args);
+
+static i32 eval_fail(evaluation *e) {
+	e->failed = true;
+	return 0;
+}
+
+static u32 eval_slot(eval_frame *frame, u32 addr) {
+	return (u32)((i32)addr / 4 + (i32)frame->arg_count);
+}
+
+static i32 eval_store(evaluation *e, eval_frame *frame, u32 addr, i32 value) {
+	u32 slot = eval_slot(frame, addr);
+	if (slot >= frame->slot_count) return eval_fail(e);
+	frame->slots[slot] = value;
+	frame->defined[slot] = true;
+	return value;
+}
+
+static i32 eval_block(evaluation *e, eval_frame *frame, u32 index) {
+	i32 value = eval_node(e, frame, index);
+	while (frame->nodes[index].next && !e->failed && !e->returning) {
+		index = frame->nodes[index].next;
+		value = eval_node(e, frame, index);
+	}
+	return value;
+}
+
+static i32 eval_call(evaluation *e, eval_frame *frame, node_extra *extra) {
+	func *callee = e->ctx->parser.functions + extra->func_call.index;
+	arena_checkpoint checkpoint = bump_checkpoint(e->ctx, ARENA_FRONT_END);
+	i32 *args = bump_alloc(e->ctx, ARENA_FRONT_END, sizeof(i32) * callee->arg_count);
 
-	while (!error_occurred) {
-		node_type type = 0;
+	u32 arg_count = 0;
+	for (u32 arg = extra->func_call.args; arg && !e->failed; arg = frame->nodes[arg].next) {
+		args[arg_count++] = eval_node(e, frame, arg);
+	}
+
+	i32 value = (e->failed || e->returning) ? 0 : eval_function(e, callee, args);
+	bump_restore(e->ctx, ARENA_FRONT_END, checkpoint);
+	return value;
+}
 
-		switch (current_token().type) {
-			case '+': 		type = NODE_PLUS; break;
-			case '-': 		type = NODE_MINUS; break;
-			case '*': 		type = NODE_MULTIPLY; break;
-			case '/': 		type = NODE_DIVIDE; break;
-			case TOKEN_EQ: 	type = NODE_EQ; break;
-			case TOKEN_NE: 	type = NODE_NE; break;
-			case '<': 		type = NODE_LT; break;
-			case '>': 		type = NODE_GT; break;
-			case TOKEN_LE: 	type = NODE_LE; break;
-			case TOKEN_GE: 	type = NODE_GE; break;
-			case '=': 		type = NODE_ASSIGN; break;
+static i32 eval_node(evaluation *e, eval_frame *frame, u32 index) {
+	if (e->failed || e->returning) return 0;
+	if (++e->steps > EVAL_STEP_BUDGET) return eval_fail(e);
+
+	node *n = frame->nodes + index;
+	node_extra *extra = extra_of(n);
+
+	switch (n->type) {
+		case NODE_INT:
+			return n->value;
+
+		case NODE_VAR: {
+			u32 slot = eval_slot(frame, n->var.addr);
+			if (slot >= frame->slot_count || !frame->defined[slot]) return eval_fail(e);
+			return frame->slots[slot];
 		}
 
-		if (!type) break;
+		case NODE_FUNC_CALL:
+			return eval_call(e, frame, extra);
+
+		case NODE_NEGATE:
+			return (u32)eval_node(e, frame, n->right) * (u32)-1;
+
+		case NODE_ASSIGN: {
+			node *target = frame->nodes + n->left;
+			if (target->type != NODE_VAR) return eval_fail(e);
+			i32 value = eval_node(e, frame, n->right);
+			return (e->failed || e->returning) ? 0 : eval_store(e, frame, target->var.addr, value);
+		}
+
+		case NODE_INT_DECL: {
+			i32 value = eval_node(e, frame, n->right);
+			if (!e->failed && !e->returning) eval_store(e, frame, n->var.addr, value);
+			return 0;
+		}
+
+		case NODE_IF: {
+			i32 cond = eval_node(e, frame, extra->if_stmt.cond);
+			u32 branch = (cond) ? extra->if_stmt.body : extra->if_stmt.else_stmt;
+			if (branch) eval_block(e, frame, branch);
+			return 0;
+		}
+
+		case NODE_LOOP: {
+			if (extra->loop_stmt.start) eval_node(e, frame, extra->loop_stmt.start);
+			while (!e->failed && !e->returning) {
+				if (++e->steps > EVAL_STEP_BUDGET) return eval_fail(e);
+				if (extra->loop_stmt.condition && !eval_node(e, frame, extra->loop_stmt.condition)) break;
+				if (extra->loop_stmt.body) eval_block(e, frame, extra->loop_stmt.body);
+				if (extra->loop_stmt.iteration) eval_block(e, frame, extra->loop_stmt.iteration);
+			}
+			return 0;
+		}
+
+		case NODE_DO_WHILE: {
+			while (!e->failed && !e->returning) {
+				if (extra->loop_stmt.body) eval_block(e, frame, extra->loop_stmt.body);
+				if (!eval_node(e, frame, extra->loop_stmt.condition)) break;
+			}
+			return 0;
+		}
+
+		case NODE_RETURN: {
+			i32 value = eval_node(e, frame, n->right);
+			if (!e->failed && !e->returning) {
+				e->returning = true;
+				e->return_value = value;
+			}
+			return 0;
+		}
+
+		default: {
+			if (n->type < NODE_PLUS || n->type > NODE_LE) return eval_fail(e);
+			i32 left = eval_node(e, frame, n->left);
+			i32 right = eval_node(e, frame, n->right);
+			i32 value = 0;
+			if (e->failed || e->returning) return 0;
+			if (!fold_binary(n->type, left, right, &value)) return eval_fail(e);
+			return value;
+		}
+	}
+}
+
+static i32 eval_function(evaluation *e, func *f, i32 *args) {
+	if (!f->pure_nodes || !f->body || e->depth == EVAL_MAX_DEPTH) return eval_fail(e);
+
+	arena_checkpoint checkpoint = bump_checkpoint(e->ctx, ARENA_FRONT_END);
+	eval_frame frame = { f->pure_nodes, f->arg_count, f->arg_count + f->locals.frame_size / 4 };
+	frame.slots = bump_alloc(e->ctx, ARENA_FRONT_END, sizeof(i32) * frame.slot_count);
+	frame.defined = bump_alloc(e->ctx, ARENA_FRONT_END, sizeof(bool) * frame.slot_count);
+	for (u32 i = 0; i < f->arg_count; ++i) {
+		frame.slots[f->arg_count - 1 - i] = args[i];
+	}
+	__builtin_memset(frame.defined, 0, sizeof(bool) * frame.slot_count);
+	__builtin_memset(frame.defined, 1, sizeof(bool) * f->arg_count);
+
+	e->depth += 1;
+	i32 value = eval_block(e, &frame, f->body);
+	e->depth -= 1;
+	if (e->returning) {
+		value = e->return_value;
+		e->returning = false;
+	}
 
-		u32 prev_prec = (op_stack->type != 0) ? get_precedence(op_stack->type) : 0;
-		u32 current_prec = get_precedence(type);
+	bump_restore(e->ctx, ARENA_FRONT_END, checkpoint);
+	return value;
+}
 
-		if (current_prec <= prev_prec) {
-			node *primary = primary_stack;
-			primary_stack = primary_stack->next;
+bool evaluate_call(compiler_ctx *ctx, func *f, u32 args, i32 *value) {
+	if (!f->pure_nodes) return false;
+	for (u32 arg = args; arg; arg = node_at(ctx, arg)->next) {
+		if (node_at(ctx, arg)->type != NODE_INT) return false;
+	}
 
-			node *op_node = op_stack;
-			op_stack = op_stack->next;
+	arena_checkpoint checkpoint = bump_checkpoint(ctx, ARENA_FRONT_END);
+	i32 *values = bump_alloc(ctx, ARENA_FRONT_END, sizeof(i32) * f->arg_count);
+	u32 arg_count = 0;
+	for (u32 arg = args; arg; arg = node_at(ctx, arg)->next) {
+		values[arg_count++] = node_at(ctx, arg)->value;
+	}
 
-			op_node->right = primary;
+	evaluation e = { ctx };
+	*value = eval_function(&e, f, values);
+	bump_restore(ctx, ARENA_FRONT_END, checkpoint);
+	return !e.failed;
+}
 
-			node *local_top = op_node;
+// Operator precedence parsing with two stacks linked through `next`, the
+// operands waiting for an operator and the operators waiting for their right side.
+u32 expr(compiler_ctx *ctx) {
+	u32 primary_stack = 0;
+	u32 op_stack = 0;
+	u32 top_node = 0;
 
-			while (op_stack && current_prec <= get_precedence(op_stack->type)) {
+	top_node = unary(ctx);
+	if (!top_node) return 0;
+
+	while (!ctx->parser.error_occurred) {
+		node_type type = binary_operator(peek(ctx, 0));
+		if (!type) break;
+
+		if (op_stack && reduces_before(node_at(ctx, op_stack)->type, type)) {
+			u32 primary = primary_stack;
+			primary_stack = node_at(ctx, primary_stack)->next;
+
+			u32 op_node = op_stack;
+			op_stack = node_at(ctx, op_stack)->next;
+
+			node_at(ctx, op_node)->right = primary;
+
+			u32 local_top = op_node;
+
+			while (op_stack && reduces_before(node_at(ctx, op_stack)->type, type)) {
 				primary = primary_stack;
-				primary_stack = primary_stack->next;
+				primary_stack = node_at(ctx, primary_stack)->next;
 
-				op_node->left = primary;
-				simplify_node(op_node);
+				node_at(ctx, op_node)->left = primary;
+				simplify_node(ctx, op_node);
 
 				op_node = op_stack;
-				op_stack = op_stack->next;
+				op_stack = node_at(ctx, op_stack)->next;
 
-				op_node->right = local_top;
+				node_at(ctx, op_node)->right = local_top;
 				local_top = op_node;
 			}
 
 			if (!op_stack) {
-				local_top->left = top_node;
+				node_at(ctx, local_top)->left = top_node;
 				top_node = local_top;
-				simplify_node(top_node);
+				simplify_node(ctx, top_node);
 			} else {
-				local_top->left = primary_stack;
-				primary_stack = primary_stack->next;
-				local_top->next = primary_stack;
+				node_at(ctx, local_top)->left = primary_stack;
+				primary_stack = node_at(ctx, primary_stack)->next;
+				node_at(ctx, local_top)->next = primary_stack;
 				primary_stack = local_top;
 			}
 		}
 
-		node *new_node = allocate_node();
-		new_node->type = type;
-		new_node->next = op_stack;
+		u32 new_node = allocate_node(ctx);
+		node_at(ctx, new_node)->type = type;
+		node_at(ctx, new_node)->next = op_stack;
 		op_stack = new_node;
-		advance_token();
+		advance_token(ctx);
 
-		node *primary_node = unary();
-		primary_node->next = primary_stack;
+		u32 primary_node = unary(ctx);
+		if (!primary_node) break;
+		node_at(ctx, primary_node)->next = primary_stack;
 		primary_stack = primary_node;
 	}
 
-	if (error_occurred) return 0;
+	if (ctx->parser.error_occurred) return 0;
+	if (!op_stack) return top_node;
 
-	node *primary = primary_stack;
-	primary_stack = primary_stack->next;
+	u32 primary = primary_stack;
+	primary_stack = node_at(ctx, primary_stack)->next;
 
-	node *op_node = op_stack;
-	op_stack = op_stack->next;
+	u32 op_node = op_stack;
+	op_stack = node_at(ctx, op_stack)->next;
 
-	op_node->right = primary;
+	node_at(ctx, op_node)->right = primary;
 
-	node *local_top = op_node;
+	u32 local_top = op_node;
 
 	while (op_stack) {
 		primary = primary_stack;
-		primary_stack = primary_stack->next;
+		primary_stack = node_at(ctx, primary_stack)->next;
 
-		op_node->left = primary;
+		node_at(ctx, op_node)->left = primary;
 
-		simplify_node(op_node);
+		simplify_node(ctx, op_node);
 
 		op_node = op_stack;
-		op_stack = op_stack->next;
+		op_stack = node_at(ctx, op_stack)->next;
 
-		op_node->right = local_top;
+		node_at(ctx, op_node)->right = local_top;
 		local_top = op_node;
 	}
 
-	if (local_top) {
-		local_top->left = top_node;
+	node_at(ctx, local_top)->left = top_node;
+	top_node = local_top;
+
+	simplify_node(ctx, top_node);
 
-		top_node = local_top;
+	return top_node;
+}
+
+// Direct emit: the same grammar parsed in one pass, with every construct
+// written out through the emit_ functions as soon as it's parsed. No nodes are
+// built and nothing is folded, so this is the fast and unoptimized mode.
+
+// What the code of the operand just emitted was. A variable or dereference ends
+// with its i32.load at load_at, which = and & take back to get the address.
+typedef struct operand operand;
+struct operand {
+	u32 start;
+	u32 load_at;
+	bool lvalue;
+	bool pointer;
+};
+
+static u32 direct_statement(compiler_ctx *ctx);
+static operand direct_expr(compiler_ctx *ctx, u32 min_precedence);
+
+// one statement or a braced block, returns how many statements left a value
+static u32 direct_block(compiler_ctx *ctx, bool braced) {
+	u32 depth = 1;
+	u32 statements = 0;
+	if (braced) expect_token(ctx, '{');
+
+	while (depth > 0 && !ctx->parser.error_occurred && peek(ctx, 0) != 0) {
+		while (braced && peek(ctx, 0) == '{') {
+			++depth;
+			enter_scope(ctx);
+			advance_token(ctx);
+		}
+
+		if (peek(ctx, 0) == ';') {
+			advance_token(ctx);
+		} else {
+			// the last statement's value is the block's, so values are dropped once the next one starts
+			if (statements) emit_drop(ctx);
+			statements += direct_statement(ctx);
+		}
+
+		if (!braced) return statements;
+
+		while (peek(ctx, 0) == '}' && depth > 0) {
+			--depth;
+			if (depth) leave_scope(ctx);
+			advance_token(ctx);
+		}
 	}
 
-	simplify_node(top_node);
+	if (depth != 0 && !ctx->parser.error_occurred) {
+		set_error_msg(ctx, "Bracket mismatch on line %l");
+		ctx->parser.error_occurred = true;
+	}
 
-	return top_node;
+	return statements;
+}
+
+// a loop or if body in its own scope, whose value is dropped
+static void direct_body(compiler_ctx *ctx) {
+	enter_scope(ctx);
+	if (direct_block(ctx, peek(ctx, 0) == '{')) emit_drop(ctx);
+	leave_scope(ctx);
+}
+
+static void direct_decl(compiler_ctx *ctx) {
+	advance_token(ctx);
+
+	u32 pointer_indirections = 0;
+	while (peek(ctx, 0) == '*') {
+		pointer_indirections += 1;
+		advance_token(ctx);
+	}
+
+	if (peek(ctx, 0) != TOKEN_IDENTIFIER) {
+		ctx->parser.error_occurred = true;
+		expected_identifier(ctx, IDENTIFIER_VAR);
+		return;
+	}
+
+	variable *var = add_variable(ctx, peek_value(ctx, 0), pointer_indirections);
+	if (!var) {
+		ctx->parser.error_occurred = true;
+		redeclaration_error(ctx, IDENTIFIER_VAR, peek_value(ctx, 0));
+		return;
+	}
+	advance_token(ctx);
+
+	expect_token(ctx, '=');
+
+	emit_var_addr(ctx, var->addr);
+	direct_expr(ctx, PRECEDENCE_ASSIGNMENT);
+	emit_store(ctx);
+	emit_int(ctx, 0);
+}
+
+static u32 direct_statement(compiler_ctx *ctx) {
+	if (peek(ctx, 0) == TOKEN_INT_DECL) {
+		direct_decl(ctx);
+		expect_token(ctx, ';');
+		return 1;
+	}
+
+	if (peek(ctx, 0) == TOKEN_IF) {
+		advance_token(ctx);
+
+		expect_token(ctx, '(');
+		direct_expr(ctx, PRECEDENCE_ASSIGNMENT);
+		expect_token(ctx, ')');
+
+		emit_if(ctx);
+		direct_body(ctx);
+
+		if (peek(ctx, 0) == TOKEN_ELSE) {
+			advance_token(ctx);
+			emit_else(ctx);
+			direct_body(ctx);
+		}
+
+		emit_if_end(ctx);
+		return 1;
+	}
+
+	// the iteration is parsed before the body but runs after it, so its code is cut out and put back later
+	if (peek(ctx, 0) == TOKEN_FOR) {
+		advance_token(ctx);
+
+		enter_scope(ctx);
+		expect_token(ctx, '(');
+		if (peek(ctx, 0) != ';') {
+			if (peek(ctx, 0) == TOKEN_INT_DECL) direct_decl(ctx);
+			else direct_expr(ctx, PRECEDENCE_ASSIGNMENT);
+			emit_drop(ctx);
+		}
+		expect_token(ctx, ';');
+
+		emit_loop_begin(ctx);
+		if (peek(ctx, 0) != ';') {
+			direct_expr(ctx, PRECEDENCE_ASSIGNMENT);
+			emit_loop_exit_unless(ctx);
+		}
+		expect_token(ctx, ';');
+
+		u32 iteration_length = 0;
+		u8 *iteration = 0;
+		if (peek(ctx, 0) != ')') {
+			u32 iteration_start = emit_position(ctx);
+			direct_expr(ctx, PRECEDENCE_ASSIGNMENT);
+			iteration = emit_cut(ctx, iteration_start, &iteration_length);
+		}
+		expect_token(ctx, ')');
+
+		direct_body(ctx);
+		leave_scope(ctx);
+
+		if (iteration) {
+			emit_bytes(ctx, iteration, iteration_length);
+			emit_drop(ctx);
+		}
+
+		emit_loop_end(ctx);
+		return 1;
+	}
+
+	if (peek(ctx, 0) == TOKEN_WHILE) {
+		advance_token(ctx);
+
+		emit_loop_begin(ctx);
+		expect_token(ctx, '(');
+		direct_expr(ctx, PRECEDENCE_ASSIGNMENT);
+		expect_token(ctx, ')');
+		emit_loop_exit_unless(ctx);
+
+		direct_body(ctx);
+
+		emit_loop_end(ctx);
+		return 1;
+	}
+
+	if (peek(ctx, 0) == TOKEN_DO) {
+		advance_token(ctx);
+
+		emit_loop_begin(ctx);
+		direct_body(ctx);
+
+		expect_token(ctx, TOKEN_WHILE);
+		expect_token(ctx, '(');
+		direct_expr(ctx, PRECEDENCE_ASSIGNMENT);
+		expect_token(ctx, ')');
+		expect_token(ctx, ';');
+		emit_loop_exit_unless(ctx);
+
+		emit_loop_end(ctx);
+		return 1;
+	}
+
+	if (peek(ctx, 0) == TOKEN_RETURN) {
+		advance_token(ctx);
+
+		direct_expr(ctx, PRECEDENCE_ASSIGNMENT);
+		emit_return(ctx);
+
+		expect_token(ctx, ';');
+		return 1;
+	}
+
+	direct_expr(ctx, PRECEDENCE_ASSIGNMENT);
+	expect_token(ctx, ';');
+	return 1;
+}
+
+static void direct_call(compiler_ctx *ctx, u32 symbol) {
+	func *f = find_function(ctx, symbol);
+	if (!f) {
+		ctx->parser.error_occurred = true;
+		not_found_error(ctx, IDENTIFIER_FUNC, symbol);
+		return;
+	}
+	advance_token(ctx);
+
+	u32 stack_pointer = ctx->parser.current_function->locals.stack_pointer;
+	emit_call_begin(ctx, stack_pointer);
+
+	expect_token(ctx, '(');
+
+	if (f->arg_count) {
+		u32 arg_count = 0;
+
+		while (!ctx->parser.error_occurred) {
+			direct_expr(ctx, PRECEDENCE_ASSIGNMENT);
+			arg_count += 1;
+
+			if (peek(ctx, 0) != ',') break;
+			advance_token(ctx);
+		}
+
+		if (!ctx->parser.error_occurred && arg_count != f->arg_count) {
+			ctx->parser.error_occurred = true;
+			set_error_msg(ctx, "function %i called with incorrect number of arguments on line %l\nRequires %d arguments, but %d were given",
+					symbol_name(ctx, symbol),
+					f->arg_count,
+					arg_count);
+			return;
+		}
+	}
+
+	expect_token(ctx, ')');
+
+	emit_call_end(ctx, f->func_idx, stack_pointer);
+}
+
+static operand direct_primary(compiler_ctx *ctx) {
+	operand result = { .start = emit_position(ctx) };
+
+	if (peek(ctx, 0) == '(') {
+		advance_token(ctx);
+		result = direct_expr(ctx, PRECEDENCE_ASSIGNMENT);
+		expect_token(ctx, ')');
+		return result;
+	}
+
+	if (peek(ctx, 0) == TOKEN_IDENTIFIER) {
+		u32 symbol = peek_value(ctx, 0);
+		if (peek(ctx, 1) == '(') {
+			direct_call(ctx, symbol);
+			return result;
+		}
+
+		variable *var = find_variable(ctx, symbol);
+		if (!var) {
+			ctx->parser.error_occurred = true;
+			not_found_error(ctx, IDENTIFIER_VAR, symbol);
+			return result;
+		}
+		advance_token(ctx);
+
+		emit_var_addr(ctx, var->addr);
+		result.load_at = emit_position(ctx);
+		result.lvalue = true;
+		result.pointer = var->pointer_indirections > 0;
+		emit_load(ctx);
+		return result;
+	}
+
+	if (peek(ctx, 0) == TOKEN_INT) {
+		emit_int(ctx, peek_value(ctx, 0));
+		advance_token(ctx);
+		return result;
+	}
+
+	if (!ctx->parser.error_occurred) {
+		set_error_msg(ctx, "Invalid expression on line: %l");
+		ctx->parser.error_occurred = true;
+	}
+	return result;
+}
+
+static operand direct_unary(compiler_ctx *ctx) {
+	u32 start = emit_position(ctx);
+
+	if (peek(ctx, 0) == '-') {
+		advance_token(ctx);
+		if (peek(ctx, 0) == TOKEN_INT) {
+			emit_int(ctx, -(i32)peek_value(ctx, 0));
+			advance_token(ctx);
+		} else {
+			direct_primary(ctx);
+			emit_int(ctx, -1);
+			emit_binary(ctx, NODE_MULTIPLY);
+		}
+		return (operand){ .start = start };
+	}
+
+	if (peek(ctx, 0) == '*') {
+		advance_token(ctx);
+		direct_unary(ctx);
+		operand result = { .start = start, .load_at = emit_position(ctx), .lvalue = true };
+		emit_load(ctx);
+		return result;
+	}
+
+	if (peek(ctx, 0) == '&') {
+		advance_token(ctx);
+		operand target = direct_unary(ctx);
+		if (!target.lvalue) {
+			if (!ctx->parser.error_occurred) {
+				set_error_msg(ctx, "Expected a variable or a dereference after & on line %l");
+				ctx->parser.error_occurred = true;
+			}
+			return target;
+		}
+
+		emit_truncate(ctx, target.load_at);
+		return (operand){ .start = start, .pointer = true };
+	}
+
+	return direct_primary(ctx);
+}
+
+// Precedence climbing, every operand is emitted before its operator. An
+// assignment takes the load off its left side and emits the address a second
+// time after the store to load the assigned value, as the tree path does.
+static operand direct_expr(compiler_ctx *ctx, u32 min_precedence) {
+	operand left = direct_unary(ctx);
+
+	while (!ctx->parser.error_occurred) {
+		node_type type = binary_operator(peek(ctx, 0));
+		if (!type) break;
+
+		u32 precedence = get_precedence(type);
+		if (precedence < min_precedence) break;
+		advance_token(ctx);
+
+		if (type == NODE_ASSIGN) {
+			if (!left.lvalue) {
+				set_error_msg(ctx, "Expected a variable or a dereference left of = on line %l");
+				ctx->parser.error_occurred = true;
+				break;
+			}
+
+			emit_truncate(ctx, left.load_at);
+			direct_expr(ctx, precedence);
+			emit_store(ctx);
+			emit_copy(ctx, left.start, left.load_at - left.start);
+			emit_load(ctx);
+			left = (operand){ .start = left.start };
+			continue;
+		}
+
+		direct_expr(ctx, precedence + 1);
+		if (left.pointer && (type == NODE_PLUS || type == NODE_MINUS)) {
+			emit_int(ctx, 4);
+			emit_binary(ctx, NODE_MULTIPLY);
+		}
+		emit_binary(ctx, type);
+		left = (operand){ .start = left.start };
+	}
+
+	return left;
+}
+
+bool parse_body_direct(compiler_ctx *ctx) {
+	emit_function_begin(ctx, ctx->parser.current_function);
+	direct_block(ctx, true);
+	if (ctx->parser.error_occurred) return false;
+
+	emit_function_end(ctx);
+	return true;
 }
@@ -32,71 +32,140 @@ enum node_type {
 	NODE_RETURN,
 };
 
-// TODO: perhaps, we can avoid making a tree
+// Nodes are 16 bytes and refer to each other by their index in the function's
+// node array, 0 meaning no node. if, loops and calls have more children than
+// fit, so they take two slots and keep a node_extra in the second one.
 typedef struct node node;
 struct node {
 	node_type type;
-	node *next;
+	u32 next;
 
 	union {
 		i32 value;
 		struct {
-			u32 index;
-			u32 stack_pointer;
-			node *args;
-		} func_call;
+			u32 left;
+			u32 right;
+		};
 		struct {
 			u32 addr;
 			u32 pointer_indirections;
 		} var;
-		struct {
-			node *left;
-			node *right;
-		};
-		struct {
-			node *cond;
-			node *body;
-			node *else_stmt;
-		} if_stmt;
-		struct {
-			node *start;
-			node *condition;
-			node *iteration;
-			node *body;
-		} loop_stmt;
 	};
 };
 
+_Static_assert(sizeof(node) == 16, "nodes are packed 4 to a cache line");
+
+typedef union node_extra node_extra;
+union node_extra {
+	struct {
+		u32 index;
+		u32 stack_pointer;
+		u32 args;
+	} func_call;
+	struct {
+		u32 cond;
+		u32 body;
+		u32 else_stmt;
+	} if_stmt;
+	struct {
+		u32 start;
+		u32 condition;
+		u32 iteration;
+		u32 body;
+	} loop_stmt;
+};
+
+static inline node_extra *extra_of(node *n) {
+	return (node_extra *)(n + 1);
+}
+
 typedef struct variable variable;
 struct variable {
-	identifier identifier;
+	u32 symbol;
 	i32 addr;
 	u32 pointer_indirections;
+	u32 depth;    // of the scope it was declared in
+	u32 shadowed; // index of the variable with the same name it hides, SYMBOL_NOT_FOUND if none
 };
 
-typedef struct variable_node variable_node;
-struct variable_node {
-	variable variable;
-	variable_node *left;
-	variable_node *right;
+// open addressing map from a symbol id to an index, keys hold symbol + 1 so 0 marks an empty slot
+typedef struct symbol_map symbol_map;
+struct symbol_map {
+	u32 *keys;
+	u32 *values;
+	u32 mask;
+	u32 count;
 };
 
-typedef struct variable_bst variable_bst;
-struct variable_bst {
-	variable_node *head;
+#define SYMBOL_NOT_FOUND 0xFFFFFFFF
+
+// Parameters come first with negative addresses, then the locals of the
+// scopes currently open. The map points at the innermost variable of each
+// name. Leaving a scope pops its variables and hands their stack slots to
+// whatever is declared next, so stack_pointer is the size of the live locals.
+typedef struct variable_table variable_table;
+struct variable_table {
+	variable *variables;
+	u32 count;
+	u32 capacity;
+	symbol_map map;
 	u32 stack_pointer;
+	u32 frame_size; // the most stack_pointer ever was
+	u32 depth;
 };
 
 typedef struct func func;
 struct func {
-	identifier identifier;
+	u32 symbol;
 	u32 func_idx;
-	variable_bst locals;
-	variable *args;
+	variable_table locals;
 	u32 arg_count;
-	node *body;
-	func *left;
-	func *right;
+	node *nodes; // only valid until the AST arena is reset
+	u32 body;
+	u64 hash;        // of everything the body's code depends on, 0 if the body can't be cached
+	u32 body_tokens;
+	u32 body_start; // token index of the body's {
+	bool pure;         // no & or dereference and only pure callees, so a call with constant arguments can be evaluated
+	bool uses_addresses; // has an & or a dereference, so its variables have to stay in its stack frame
+	node *pure_nodes;  // a pure function's nodes, kept past the AST arena for evaluating calls to it
+};
+
+// Wraps like the i32 instructions do. A division that would trap isn't
+// folded, so it still traps when it runs.
+bool fold_binary(node_type type, i32 left, i32 right, i32 *value);
+// runs a call to a pure function whose arguments are all NODE_INT, false if it can't be evaluated
+bool evaluate_call(compiler_ctx *ctx, func *f, u32 args, i32 *value);
+
+typedef struct parser_state parser_state;
+struct parser_state {
+	bool error_occurred;
+	func *current_function;
+
+	func *functions;
+	u32 function_capacity;
+	u32 function_count;
+	symbol_map function_map;
+
+	// The nodes of the function being parsed live in one array and refer to each
+	// other by index. Index 0 is never handed out, it reads as an empty node and
+	// stands for "no node". The array is a reservation in the AST arena that moves
+	// when it grows, so a node_at pointer is only good until the next allocation.
+	node *nodes;
+	u32 node_count;
+	u32 node_capacity;
+	u32 free_node_stack;
 };
 
-func *parse_tokens(u32 *function_count);
+void parse_begin(compiler_ctx *ctx);
+// Returns the next function with its signature parsed and its body hashed, or
+// 0 at the end of the tokens or after an error. Its body is then either parsed
+// into nodes, parsed while emitting its code (see code_gen.h) or skipped.
+func *parse_signature(compiler_ctx *ctx);
+bool parse_body(compiler_ctx *ctx);
+bool parse_body_direct(compiler_ctx *ctx);
+void skip_body(compiler_ctx *ctx);
+// makes f current again and moves to its body, so a context sharing this one's
+// tokens and functions can compile it
+void seek_body(compiler_ctx *ctx, func *f);
+// returns the functions indexed by func_idx, or 0 if parsing failed
+func *parsed_functions(compiler_ctx *ctx, u32 *function_count);
@@ -0,0 +1,224 @@
+#include "compiler.h"
+#include "code_gen_wasm.h"
+
+// A pass over a function's finished code. Every instruction is copied down
+// to the end of what's kept so far, then the rules look at the last few
+// instructions kept and may replace them with fewer bytes, until none
+// matches. Nothing jumps into the middle of straight code in wasm, so the
+// instructions a rule sees always run together.
+#define PEEPHOLE_HISTORY 8
+#define MAX_REPLACEMENT 16
+
+typedef struct peephole_state peephole_state;
+struct peephole_state {
+	u8 *out; // where the next kept instruction goes
+	u8 *kept[PEEPHOLE_HISTORY]; // the last instructions kept, the newest last
+	u32 count;
+};
+
+// the instruction back places before the newest one kept, 0 if there's none that far back
+static u8 *kept(peephole_state *p, u32 back) {
+	return (back < p->count) ? p->kept[p->count - 1 - back] : 0;
+}
+
+// unreachable, which code_gen never writes, if there's no instruction that far back
+static u8 opcode(peephole_state *p, u32 back) {
+	u8 *instruction = kept(p, back);
+	return (instruction) ? *instruction : 0;
+}
+
+static void keep(peephole_state *p, u8 *instruction, u32 length) {
+	__builtin_memmove(p->out, instruction, length);
+	if (p->count == PEEPHOLE_HISTORY) {
+		__builtin_memmove(p->kept, p->kept + 1, sizeof(u8 *) * (PEEPHOLE_HISTORY - 1));
+		p->count -= 1;
+	}
+	p->kept[p->count++] = p->out;
+	p->out += length;
+}
+
+// Replaces the newest count instructions with the replacement's. The code is
+// rewritten in place, so a replacement may not be longer than what it replaces.
+static bool replace(peephole_state *p, u32 count, u8 *replacement, u32 length) {
+	u8 *first = kept(p, count - 1);
+	if (first + length > p->out) return false;
+
+	p->out = first;
+	p->count -= count;
+	for (u8 *c = replacement; c < replacement + length; c += instruction_length(c)) {
+		keep(p, c, instruction_length(c));
+	}
+	return true;
+}
+
+static bool same_instruction(u8 *a, u8 *b) {
+	u32 length = instruction_length(a);
+	if (length != instruction_length(b)) return false;
+	for (u32 i = 0; i < length; ++i) {
+		if (a[i] != b[i]) return false;
+	}
+	return true;
+}
+
+static bool drop_constant(peephole_state *p) {
+	if (opcode(p, 0) != DROP) return false;
+	if (opcode(p, 1) != I32_CONST && opcode(p, 1) != LOCAL_GET) return false;
+	return replace(p, 2, 0, 0);
+}
+
+// the frame pointer is the only local code_gen loads through, so these loads can't trap
+static bool drop_frame_load(peephole_state *p) {
+	if (opcode(p, 0) != DROP || opcode(p, 1) != I32_LOAD || opcode(p, 2) != LOCAL_GET) return false;
+	return replace(p, 3, 0, 0);
+}
+
+static bool tee_drop(peephole_state *p) {
+	if (opcode(p, 0) != DROP || opcode(p, 1) != LOCAL_TEE) return false;
+	u8 replacement[MAX_REPLACEMENT];
+	u32 length = instruction_length(kept(p, 1));
+	__builtin_memcpy(replacement, kept(p, 1), length);
+	replacement[0] = LOCAL_SET;
+	return replace(p, 2, replacement, length);
+}
+
+// local.get f; i32.const k; i32.store o; local.get f; i32.load o, which is how a constant is assigned
+static bool reload_constant(peephole_state *p) {
+	if (opcode(p, 0) != I32_LOAD || opcode(p, 1) != LOCAL_GET || opcode(p, 2) != I32_STORE) return false;
+	if (opcode(p, 3) != I32_CONST || opcode(p, 4) != LOCAL_GET) return false;
+	if (!same_instruction(kept(p, 1), kept(p, 4))) return false;
+
+	u8 *load = kept(p, 0);
+	u8 *store = kept(p, 2);
+	u32 length = instruction_length(load);
+	if (length != instruction_length(store)) return false;
+	for (u32 i = 1; i < length; ++i) {
+		if (load[i] != store[i]) return false;
+	}
+
+	u8 replacement[MAX_REPLACEMENT];
+	length = instruction_length(kept(p, 3));
+	__builtin_memcpy(replacement, kept(p, 3), length);
+	return replace(p, 2, replacement, length);
+}
+
+static bool fold_constants(peephole_state *p) {
+	u8 operation = opcode(p, 0);
+	if (operation != I32_ADD && operation != I32_SUB && operation != I32_MUL) return false;
+	if (opcode(p, 1) != I32_CONST || opcode(p, 2) != I32_CONST) return false;
+
+	u8 length;
+	u32 right = decode_integer(kept(p, 1) + 1, &length);
+	u32 left = decode_integer(kept(p, 2) + 1, &length);
+	u32 value = (operation == I32_ADD) ? left + right : (operation == I32_SUB) ? left - right : left * right;
+
+	u8 replacement[MAX_REPLACEMENT];
+	return replace(p, 3, replacement, i32_const(replacement, value));
+}
+
+static bool invert_comparison(peephole_state *p) {
+	if (opcode(p, 0) != I32_EQZ) return false;
+
+	u8 inverse = 0;
+	switch (opcode(p, 1)) {
+		case I32_EQ: inverse = I32_NE; break;
+		case I32_NE: inverse = I32_EQ; break;
+		case I32_LT_S: inverse = I32_GE_S; break;
+		case I32_GE_S: inverse = I32_LT_S; break;
+		case I32_GT_S: inverse = I32_LE_S; break;
+		case I32_LE_S: inverse = I32_GT_S; break;
+		default: return false;
+	}
+	return replace(p, 2, &inverse, 1);
+}
+
+static bool is_constant(peephole_state *p, u32 back, i32 value) {
+	if (opcode(p, back) != I32_CONST) return false;
+	u8 length;
+	return decode_integer(kept(p, back) + 1, &length) == value;
+}
+
+static bool equals_zero(peephole_state *p) {
+	if (opcode(p, 0) != I32_EQ || !is_constant(p, 1, 0)) return false;
+	u8 eqz = I32_EQZ;
+	return replace(p, 2, &eqz, 1);
+}
+
+// br_if and if only ask whether the condition isn't 0
+static bool keep_branch(peephole_state *p, u32 count) {
+	u8 replacement[MAX_REPLACEMENT];
+	u32 length = instruction_length(kept(p, 0));
+	__builtin_memcpy(replacement, kept(p, 0), length);
+	return replace(p, count, replacement, length);
+}
+
+static bool branch_not_zero(peephole_state *p) {
+	if (opcode(p, 0) != BR_IF && opcode(p, 0) != IF) return false;
+	if (opcode(p, 1) != I32_NE || !is_constant(p, 2, 0)) return false;
+	return keep_branch(p, 3);
+}
+
+static bool double_eqz(peephole_state *p) {
+	if (opcode(p, 0) != BR_IF && opcode(p, 0) != IF) return false;
+	if (opcode(p, 1) != I32_EQZ || opcode(p, 2) != I32_EQZ) return false;
+	return keep_branch(p, 3);
+}
+
+static char *peephole_rule_names[PEEPHOLE_RULE_COUNT] = {
+	[PEEPHOLE_DROP_CONSTANT] = "drop_constant",
+	[PEEPHOLE_DROP_FRAME_LOAD] = "drop_frame_load",
+	[PEEPHOLE_TEE_DROP] = "tee_drop",
+	[PEEPHOLE_RELOAD_CONSTANT] = "reload_constant",
+	[PEEPHOLE_FOLD_CONSTANTS] = "fold_constants",
+	[PEEPHOLE_INVERT_COMPARISON] = "invert_comparison",
+	[PEEPHOLE_EQUALS_ZERO] = "equals_zero",
+	[PEEPHOLE_BRANCH_NOT_ZERO] = "branch_not_zero",
+	[PEEPHOLE_DOUBLE_EQZ] = "double_eqz",
+};
+
+static bool (*peephole_rules[PEEPHOLE_RULE_COUNT])(peephole_state *p) = {
+	[PEEPHOLE_DROP_CONSTANT] = drop_constant,
+	[PEEPHOLE_DROP_FRAME_LOAD] = drop_frame_load,
+	[PEEPHOLE_TEE_DROP] = tee_drop,
+	[PEEPHOLE_RELOAD_CONSTANT] = reload_constant,
+	[PEEPHOLE_FOLD_CONSTANTS] = fold_constants,
+	[PEEPHOLE_INVERT_COMPARISON] = invert_comparison,
+	[PEEPHOLE_EQUALS_ZERO] = equals_zero,
+	[PEEPHOLE_BRANCH_NOT_ZERO] = branch_not_zero,
+	[PEEPHOLE_DOUBLE_EQZ] = double_eqz,
+};
+
+u8 *peephole(u8 *code, u8 *end, u32 *hits) {
+	peephole_state p = { code };
+	for (u8 *c = code; c < end;) {
+		u32 length = instruction_length(c);
+		keep(&p, c, length);
+		c += length;
+
+		for (u32 rule = 0; rule < PEEPHOLE_RULE_COUNT;) {
+			if (peephole_rules[rule](&p)) {
+				hits[rule] += 1;
+				rule = 0;
+			} else {
+				rule += 1;
+			}
+		}
+	}
+	return p.out;
+}
+
+// how often each rule rewrote code in the last compile, indexed by peephole_rule_id
+__attribute__((export_name("get_peephole_hits")))
+u32 *get_peephole_hits(compiler_ctx *ctx) {
+	return ctx->gen.peephole_hits;
+}
+
+__attribute__((export_name("get_peephole_rule_count")))
+u32 get_peephole_rule_count() {
+	return PEEPHOLE_RULE_COUNT;
+}
+
+// zero terminated
+__attribute__((export_name("get_peephole_rule_name")))
+char *get_peephole_rule_name(u32 rule) {
+	return peephole_rule_names[rule];
+}
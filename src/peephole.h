@@ -0,0 +1,21 @@
+#pragma once
+#include "general.h"
+
+// the rewrites the peephole pass makes, counted per rule in a compile's peephole
+// hits. JS looks rules up by their exported names, not by these values.
+typedef enum peephole_rule_id peephole_rule_id;
+enum peephole_rule_id {
+	PEEPHOLE_DROP_CONSTANT,    // i32.const or local.get; drop -> nothing
+	PEEPHOLE_DROP_FRAME_LOAD,  // local.get; i32.load; drop -> nothing
+	PEEPHOLE_TEE_DROP,         // local.tee; drop -> local.set
+	PEEPHOLE_RELOAD_CONSTANT,  // a reload of the constant just stored -> the constant
+	PEEPHOLE_FOLD_CONSTANTS,   // i32.const; i32.const; add, sub or mul -> i32.const
+	PEEPHOLE_INVERT_COMPARISON, // comparison; i32.eqz -> the opposite comparison
+	PEEPHOLE_EQUALS_ZERO,      // i32.const 0; i32.eq -> i32.eqz
+	PEEPHOLE_BRANCH_NOT_ZERO,  // i32.const 0; i32.ne; br_if or if -> br_if or if
+	PEEPHOLE_DOUBLE_EQZ,       // i32.eqz; i32.eqz; br_if or if -> br_if or if
+	PEEPHOLE_RULE_COUNT,
+};
+
+// rewrites the instructions from code to end in place and returns their new end
+u8 *peephole(u8 *code, u8 *end, u32 *hits);
@@ -1,12 +1,14 @@
-#include "memory.h"
-#include "tokenizer.h"
+#include "compiler.h"
 #include <stdarg.h>
+#include <wasm_simd128.h>
 
 #define is_whitespace(c) (c == ' ' || c == '\r' || c == '\n' || c == '\t')
 #define is_digit(c) (c >= '0' && c <= '9')
 #define is_alpha(c) (c >= 'a' && c <= 'z' || c >= 'A' && c <= 'Z' || c == '_')
 #define is_alpha_numeric(c) (is_alpha(c) || is_digit(c))
 
+#define SIMD_WIDTH 16
+
 bool startswith(char *a, char *b, u32 length) {
 	for (u32 i = 0; i < length; ++i) {
 		if (a[i] != b[i]) return false;
@@ -14,54 +16,168 @@ bool startswith(char *a, char *b, u32 length) {
 	return true;
 }
 
-static char *c;
-static char *src;
-static u32 code_length;
-static u32 line_number;
-static token _current_token;
+// Identifiers are interned into dense symbol ids as they're lexed, so the
+// parser only ever compares and hashes integers. The keywords are interned
+// first, which lets a symbol id below KEYWORD_COUNT double as keyword detection.
+static const char *keywords[] = { "if", "do", "int", "for", "else", "while", "return" };
+static const token_type keyword_tokens[] = { TOKEN_IF, TOKEN_DO, TOKEN_INT_DECL, TOKEN_FOR, TOKEN_ELSE, TOKEN_WHILE, TOKEN_RETURN };
+#define KEYWORD_COUNT len(keywords)
+_Static_assert(SYMBOL_MAIN == KEYWORD_COUNT, "main is interned right after the keywords");
+
+static u32 hash_identifier(char *name, u32 length) {
+	u32 hash = 2166136261u;
+	for (u32 i = 0; i < length; ++i) {
+		hash ^= (u8)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void grow_symbol_table(compiler_ctx *ctx) {
+	u32 capacity = (ctx->tokenizer.symbol_table_mask + 1) * 2;
+	u32 *table = bump_alloc(ctx, ARENA_FRONT_END, sizeof(u32) * capacity);
+	__builtin_memset(table, 0, sizeof(u32) * capacity);
+
+	for (u32 i = 0; i < ctx->tokenizer.symbol_count; ++i) {
+		u32 slot = hash_identifier(ctx->tokenizer.symbols[i].name, ctx->tokenizer.symbols[i].length) & (capacity - 1);
+		while (table[slot]) slot = (slot + 1) & (capacity - 1);
+		table[slot] = i + 1;
+	}
+
+	ctx->tokenizer.symbol_table = table;
+	ctx->tokenizer.symbol_table_mask = capacity - 1;
+}
+
+static u32 intern(compiler_ctx *ctx, char *name, u32 length) {
+	u32 slot = hash_identifier(name, length) & ctx->tokenizer.symbol_table_mask;
+
+	for (; ctx->tokenizer.symbol_table[slot]; slot = (slot + 1) & ctx->tokenizer.symbol_table_mask) {
+		identifier s = ctx->tokenizer.symbols[ctx->tokenizer.symbol_table[slot] - 1];
+		if (s.length == length && startswith(s.name, name, length))
+			return ctx->tokenizer.symbol_table[slot] - 1;
+	}
+
+	if (ctx->tokenizer.symbol_count == ctx->tokenizer.symbol_capacity) {
+		identifier *new_symbols = bump_alloc(ctx, ARENA_FRONT_END, sizeof(identifier) * ctx->tokenizer.symbol_capacity * 2);
+		__builtin_memcpy(new_symbols, ctx->tokenizer.symbols, sizeof(identifier) * ctx->tokenizer.symbol_count);
+		ctx->tokenizer.symbols = new_symbols;
+		ctx->tokenizer.symbol_capacity *= 2;
+	}
+
+	// the name is copied because edit_src_code can move or overwrite the source
+	char *copy = bump_alloc(ctx, ARENA_FRONT_END, length);
+	__builtin_memcpy(copy, name, length);
+
+	u32 symbol = ctx->tokenizer.symbol_count++;
+	ctx->tokenizer.symbols[symbol] = (identifier){ copy, length };
+	ctx->tokenizer.symbol_table[slot] = symbol + 1;
+
+	if (ctx->tokenizer.symbol_count * 2 > ctx->tokenizer.symbol_table_mask)
+		grow_symbol_table(ctx);
+
+	return symbol;
+}
+
+identifier symbol_name(compiler_ctx *ctx, u32 symbol) {
+	return ctx->tokenizer.symbols[symbol];
+}
+
+token_type peek(compiler_ctx *ctx, u32 n) {
+	u32 i = min(ctx->tokenizer.token_index + n, ctx->tokenizer.token_count - 1);
+	return ctx->tokenizer.token_types[i];
+}
+
+u32 peek_value(compiler_ctx *ctx, u32 n) {
+	u32 i = min(ctx->tokenizer.token_index + n, ctx->tokenizer.token_count - 1);
+	return ctx->tokenizer.token_values[i];
+}
+
+void advance_token(compiler_ctx *ctx) {
+	if (ctx->tokenizer.token_index < ctx->tokenizer.token_count - 1) ctx->tokenizer.token_index += 1;
+}
 
-static char error_msg[128];
-static char error_msg_len;
+void advance_tokens(compiler_ctx *ctx, u32 n) {
+	ctx->tokenizer.token_index = min(ctx->tokenizer.token_index + n, ctx->tokenizer.token_count - 1);
+}
+
+u32 token_position(compiler_ctx *ctx) {
+	return ctx->tokenizer.token_index;
+}
+
+void seek_token(compiler_ctx *ctx, u32 index) {
+	ctx->tokenizer.token_index = min(index, ctx->tokenizer.token_count - 1);
+}
+
+static u32 current_offset(compiler_ctx *ctx) {
+	return ctx->tokenizer.token_offsets[min(ctx->tokenizer.token_index, ctx->tokenizer.token_count - 1)];
+}
 
 __attribute__((export_name("get_error_msg")))
-char *get_error_msg() {
-	return error_msg;
+char *get_error_msg(compiler_ctx *ctx) {
+	return ctx->tokenizer.error_msg;
 }
 
 __attribute__((export_name("get_error_msg_len")))
-u32 get_error_msg_len() {
-	u32 value = error_msg_len;
-	error_msg_len = 0;
+u32 get_error_msg_len(compiler_ctx *ctx) {
+	u32 value = ctx->tokenizer.error_msg_len;
+	ctx->tokenizer.error_msg_len = 0;
 	return value;
 }
 
 static u32 u32_to_str(u32 val, char *str) {
 	u32 length = 0;
 	do {
+		str[length] = (val % 10) + '0';
 		length += 1;
-		*str = (val % 10) + '0';
-		str += 1;
 		val /= 10;
 	} while (val);
+
+	for (u32 i = 0; i < length / 2; ++i) {
+		char temp = str[i];
+		str[i] = str[length - 1 - i];
+		str[length - 1 - i] = temp;
+	}
 	return length;
 }
 
+static inline u32 newline_bits(v128_t v) {
+	return wasm_i8x16_bitmask(wasm_i8x16_eq(v, wasm_i8x16_splat('\n')));
+}
+
+// Tokens only store their byte offset, the line is recovered here by counting
+// the newlines in front of it. This only runs when an error message is built.
+static u32 line_number_at(compiler_ctx *ctx, u32 offset) {
+	char *c = ctx->tokenizer.src;
+	char *end = ctx->tokenizer.src + min(offset, ctx->tokenizer.code_length);
+	u32 line_number = 1;
+
+	while (end - c >= SIMD_WIDTH) {
+		line_number += __builtin_popcount(newline_bits(wasm_v128_load(c)));
+		c += SIMD_WIDTH;
+	}
+
+	for (; c < end; c += 1) {
+		if (*c == '\n') line_number += 1;
+	}
+	return line_number;
+}
+
 // %l -- line number
 // %i -- identifier
 // %d -- digit
 // %s -- string
-void set_error_msg(char *format_str, ...) {
+void set_error_msg(compiler_ctx *ctx, char *format_str, ...) {
 	va_list valist;
 
 	va_start(valist, format_str);
 
-	char *c = error_msg;
+	char *c = ctx->tokenizer.error_msg;
 	for (; *format_str; ++format_str) {
 		if (*format_str == '%') {
 			format_str += 1;
 			switch (*format_str) {
 				case 'l': {
-					c += u32_to_str(line_number, c);
+					c += u32_to_str(line_number_at(ctx, current_offset(ctx)), c);
 					continue;
 				} break;
 				case 'i': {
@@ -88,13 +204,13 @@ void set_error_msg(char *format_str, ...) {
 		*c++ = *format_str;
 	}
 
-	error_msg_len = c - error_msg;
+	ctx->tokenizer.error_msg_len = c - ctx->tokenizer.error_msg;
 
 	va_end(valist);
 }
 
-void expected_identifier(identifier_type type) {
-	char *error_msg_ptr = error_msg;
+void expected_identifier(compiler_ctx *ctx, identifier_type type) {
+	char *error_msg_ptr = ctx->tokenizer.error_msg;
 	const char expected[] = "Expected ";
 	__builtin_memcpy(error_msg_ptr, expected, len(expected) - 1);
 	error_msg_ptr += len(expected) - 1;
@@ -124,14 +240,14 @@ void expected_identifier(identifier_type type) {
 	__builtin_memcpy(error_msg_ptr, on_line, len(on_line) - 1);
 	error_msg_ptr += len(on_line) - 1;
 
-	error_msg_ptr += u32_to_str(line_number, error_msg_ptr);
+	error_msg_ptr += u32_to_str(line_number_at(ctx, current_offset(ctx)), error_msg_ptr);
 
 	*error_msg_ptr = 0;
-	error_msg_len = error_msg_ptr - error_msg;
+	ctx->tokenizer.error_msg_len = error_msg_ptr - ctx->tokenizer.error_msg;
 }
 
-void redeclaration_error(identifier_type type) {
-	char *error_msg_ptr = error_msg;
+void redeclaration_error(compiler_ctx *ctx, identifier_type type, u32 symbol) {
+	char *error_msg_ptr = ctx->tokenizer.error_msg;
 	switch (type) {
 		case IDENTIFIER_FUNC: {
 			const char token_str[] = "There's already a function with the name ";
@@ -153,14 +269,15 @@ void redeclaration_error(identifier_type type) {
 		}
 	}
 
-	__builtin_memcpy(error_msg_ptr, _current_token.identifier.name, _current_token.identifier.length);
-	error_msg_ptr += _current_token.identifier.length;
+	identifier name = symbol_name(ctx, symbol);
+	__builtin_memcpy(error_msg_ptr, name.name, name.length);
+	error_msg_ptr += name.length;
 
-	error_msg_len = error_msg_ptr - error_msg;
+	ctx->tokenizer.error_msg_len = error_msg_ptr - ctx->tokenizer.error_msg;
 }
 
-void not_found_error(identifier_type type) {
-	char *error_msg_ptr = error_msg;
+void not_found_error(compiler_ctx *ctx, identifier_type type, u32 symbol) {
+	char *error_msg_ptr = ctx->tokenizer.error_msg;
 	switch (type) {
 		case IDENTIFIER_FUNC: {
 			const char token_str[] = "There's not a function with the name ";
@@ -182,8 +299,9 @@ void not_found_error(identifier_type type) {
 		}
 	}
 
-	__builtin_memcpy(error_msg_ptr, _current_token.identifier.name, _current_token.identifier.length);
-	error_msg_ptr += _current_token.identifier.length;
+	identifier name = symbol_name(ctx, symbol);
+	__builtin_memcpy(error_msg_ptr, name.name, name.length);
+	error_msg_ptr += name.length;
 
 	switch (type) {
 		case IDENTIFIER_FUNC: {
@@ -206,134 +324,491 @@ void not_found_error(identifier_type type) {
 		}
 	}
 
-	error_msg_len = error_msg_ptr - error_msg;
+	ctx->tokenizer.error_msg_len = error_msg_ptr - ctx->tokenizer.error_msg;
 }
 
-void tokenizer_init(char *code, u32 length) {
-	__builtin_memset(error_msg, 0, len(error_msg));
-	c = src = code;
-	code_length = length;
-	line_number = 1;
-	advance_token();
+// The scanners below classify SIMD_WIDTH bytes per iteration and fall back
+// to the scalar macros for the tail, so they never read past `end`.
+// Each one returns a pointer to the first byte that doesn't belong to the run.
+
+static inline v128_t whitespace_mask(v128_t v) {
+	v128_t mask = wasm_i8x16_eq(v, wasm_i8x16_splat(' '));
+	mask = wasm_v128_or(mask, wasm_i8x16_eq(v, wasm_i8x16_splat('\n')));
+	mask = wasm_v128_or(mask, wasm_i8x16_eq(v, wasm_i8x16_splat('\r')));
+	mask = wasm_v128_or(mask, wasm_i8x16_eq(v, wasm_i8x16_splat('\t')));
+	return mask;
 }
 
-token current_token() {
-	return _current_token;
+static inline v128_t digit_mask(v128_t v) {
+	return wasm_u8x16_lt(wasm_i8x16_sub(v, wasm_i8x16_splat('0')), wasm_i8x16_splat(10));
 }
 
-void advance_token() {
-	for (; c - src < code_length; c += 1) {
+static inline v128_t alpha_numeric_mask(v128_t v) {
+	v128_t lower = wasm_v128_or(v, wasm_i8x16_splat(0x20));
+	v128_t mask = wasm_u8x16_lt(wasm_i8x16_sub(lower, wasm_i8x16_splat('a')), wasm_i8x16_splat(26));
+	mask = wasm_v128_or(mask, digit_mask(v));
+	mask = wasm_v128_or(mask, wasm_i8x16_eq(v, wasm_i8x16_splat('_')));
+	return mask;
+}
 
-		if (*c == '\n') line_number += 1;
-		if (is_whitespace(*c)) continue;
+static char *skip_whitespace(char *c, char *end) {
+	while (end - c >= SIMD_WIDTH) {
+		u32 stop = ~wasm_i8x16_bitmask(whitespace_mask(wasm_v128_load(c))) & 0xFFFF;
+		if (stop) return c + __builtin_ctz(stop);
+		c += SIMD_WIDTH;
+	}
+
+	while (c < end && is_whitespace(*c)) c += 1;
+	return c;
+}
+
+static char *skip_digits(char *c, char *end) {
+	while (end - c >= SIMD_WIDTH) {
+		u32 stop = ~wasm_i8x16_bitmask(digit_mask(wasm_v128_load(c))) & 0xFFFF;
+		if (stop) return c + __builtin_ctz(stop);
+		c += SIMD_WIDTH;
+	}
+
+	while (c < end && is_digit(*c)) c += 1;
+	return c;
+}
+
+static char *skip_alpha_numeric(char *c, char *end) {
+	while (end - c >= SIMD_WIDTH) {
+		u32 stop = ~wasm_i8x16_bitmask(alpha_numeric_mask(wasm_v128_load(c))) & 0xFFFF;
+		if (stop) return c + __builtin_ctz(stop);
+		c += SIMD_WIDTH;
+	}
+
+	while (c < end && is_alpha_numeric(*c)) c += 1;
+	return c;
+}
+
+// stops on the '\n' or the null terminator
+static char *find_line_end(char *c, char *end) {
+	while (end - c >= SIMD_WIDTH) {
+		v128_t v = wasm_v128_load(c);
+		v128_t mask = wasm_i8x16_eq(v, wasm_i8x16_splat('\n'));
+		mask = wasm_v128_or(mask, wasm_i8x16_eq(v, wasm_i8x16_splat(0)));
+		u32 stop = wasm_i8x16_bitmask(mask);
+		if (stop) return c + __builtin_ctz(stop);
+		c += SIMD_WIDTH;
+	}
+
+	while (c < end && *c && *c != '\n') c += 1;
+	return c;
+}
+
+// returns the byte after the closing "*/", or `end` for an unterminated comment
+static char *find_comment_end(char *c, char *end) {
+	while (end - c > SIMD_WIDTH) {
+		v128_t star = wasm_i8x16_eq(wasm_v128_load(c), wasm_i8x16_splat('*'));
+		v128_t slash = wasm_i8x16_eq(wasm_v128_load(c + 1), wasm_i8x16_splat('/'));
+		u32 stop = wasm_i8x16_bitmask(wasm_v128_and(star, slash));
+		if (stop) return c + __builtin_ctz(stop) + 2;
+		c += SIMD_WIDTH;
+	}
+
+	for (; end - c >= 2; c += 1) {
+		if (c[0] == '*' && c[1] == '/') return c + 2;
+	}
+	return end;
+}
+
+static void reserve_tokens(compiler_ctx *ctx, u32 count) {
+	if (count <= ctx->tokenizer.token_capacity) return;
+
+	u32 capacity = max(ctx->tokenizer.token_capacity * 2, count);
+
+	u16 *types = bump_alloc(ctx, ARENA_FRONT_END, sizeof(u16) * capacity);
+	u32 *offsets = bump_alloc(ctx, ARENA_FRONT_END, sizeof(u32) * capacity);
+	u32 *values = bump_alloc(ctx, ARENA_FRONT_END, sizeof(u32) * capacity);
+	__builtin_memcpy(types, ctx->tokenizer.token_types, sizeof(u16) * ctx->tokenizer.token_count);
+	__builtin_memcpy(offsets, ctx->tokenizer.token_offsets, sizeof(u32) * ctx->tokenizer.token_count);
+	__builtin_memcpy(values, ctx->tokenizer.token_values, sizeof(u32) * ctx->tokenizer.token_count);
 
-		if (*c == '/' && *(c + 1) == '/') {
-			c += 2;
-			while (*c && *c != '\n') c += 1;
-			c -= 1;
+	ctx->tokenizer.token_types = types;
+	ctx->tokenizer.token_offsets = offsets;
+	ctx->tokenizer.token_values = values;
+	ctx->tokenizer.token_capacity = capacity;
+}
+
+static void move_tokens(compiler_ctx *ctx, u32 dst, u32 from, u32 count) {
+	__builtin_memmove(ctx->tokenizer.token_types + dst, ctx->tokenizer.token_types + from, sizeof(u16) * count);
+	__builtin_memmove(ctx->tokenizer.token_offsets + dst, ctx->tokenizer.token_offsets + from, sizeof(u32) * count);
+	__builtin_memmove(ctx->tokenizer.token_values + dst, ctx->tokenizer.token_values + from, sizeof(u32) * count);
+}
+
+static void push_token(compiler_ctx *ctx, u32 type, u32 offset, u32 value) {
+	reserve_tokens(ctx, ctx->tokenizer.token_count + 1);
+
+	ctx->tokenizer.token_types[ctx->tokenizer.token_count] = type;
+	ctx->tokenizer.token_offsets[ctx->tokenizer.token_count] = offset;
+	ctx->tokenizer.token_values[ctx->tokenizer.token_count] = value;
+	ctx->tokenizer.token_count += 1;
+}
+
+typedef struct scanned_token scanned_token;
+struct scanned_token {
+	u32 type;
+	char *start;
+	u32 value;
+};
+
+// Lexes one token, skipping the whitespace and comments in front of it.
+// It only touches `cursor`, so chunks of the source can be scanned from
+// several threads at once. Identifiers come back as TOKEN_IDENTIFIER with
+// their length as the value, interning them is left to the caller.
+static scanned_token scan_token(char **cursor, char *end) {
+	char *c = *cursor;
+
+	for (;;) {
+		c = skip_whitespace(c, end);
+
+		if (end - c >= 2 && c[0] == '/' && c[1] == '/') {
+			c = find_line_end(c + 2, end);
 			continue;
 		}
 
-		if (*c == '/' && *(c + 1) == '*') {
-			c += 2;
-			while (*c && *c != '*' && *(c + 1) != '/') c += 1;
-			c += 1;
+		if (end - c >= 2 && c[0] == '/' && c[1] == '*') {
+			c = find_comment_end(c + 2, end);
 			continue;
 		}
 
 		break;
 	}
 
-	_current_token = (token){0};
-	_current_token.type = *c;
-	_current_token.line_number = line_number;
-
-	if (is_digit(*c)) {
-		_current_token.type = TOKEN_INT;
-		_current_token.value = 0;
-		do {
-			_current_token.value *= 10;
-			_current_token.value += *c - '0';
-			c += 1;
-		} while (is_digit(*c));
-		return;
-	}
+	scanned_token t = { .start = c };
 
-	if (is_alpha(*c)) {
-		_current_token.type = TOKEN_IDENTIFIER;
-		u32 length = 1;
-		char *start = c;
-		_current_token.identifier.name = start; // TODO: make cache efficient
+	if (c >= end || *c == 0) {
+		t.type = 0;
+	} else if (is_digit(*c)) {
+		char *digits_end = skip_digits(c + 1, end);
+		for (; c < digits_end; c += 1) {
+			t.value *= 10;
+			t.value += *c - '0';
+		}
+		t.type = TOKEN_INT;
+	} else if (is_alpha(*c)) {
+		c = skip_alpha_numeric(c + 1, end);
+		t.type = TOKEN_IDENTIFIER;
+		t.value = c - t.start;
+	} else {
+		t.type = *c;
 		c += 1;
 
-		while (is_alpha_numeric(*c)) {
-			length += 1;
-			c += 1;
+		if (c < end && *c == '=') {
+			switch (t.type) {
+				case '=': t.type = TOKEN_EQ; break;
+				case '!': t.type = TOKEN_NE; break;
+				case '>': t.type = TOKEN_GE; break;
+				case '<': t.type = TOKEN_LE; break;
+			}
+			if (t.type >= TOKEN_EQ) c += 1;
 		}
+	}
 
-		_current_token.identifier.length = length;
+	*cursor = c;
+	return t;
+}
 
-		if (length == 2 && startswith(start, "if", 2)) {
-			_current_token.type = TOKEN_IF;
-			return;
-		}
+static void push_scanned_token(compiler_ctx *ctx, scanned_token t) {
+	if (t.type == TOKEN_IDENTIFIER) {
+		t.value = intern(ctx, t.start, t.value);
+		if (t.value < KEYWORD_COUNT) t.type = keyword_tokens[t.value];
+	}
+	push_token(ctx, t.type, t.start - ctx->tokenizer.src, t.value);
+}
 
-		if (length == 2 && startswith(start, "do", 2)) {
-			_current_token.type = TOKEN_DO;
-			return;
+static u32 lex_token(compiler_ctx *ctx) {
+	scanned_token t = scan_token(&ctx->tokenizer.cursor, ctx->tokenizer.src + ctx->tokenizer.code_length);
+	push_scanned_token(ctx, t);
+	return t.type;
+}
+
+void tokenizer_reset(compiler_ctx *ctx) {
+	__builtin_memset(ctx->tokenizer.error_msg, 0, len(ctx->tokenizer.error_msg));
+	ctx->tokenizer.error_msg_len = 0;
+	ctx->tokenizer.token_index = 0;
+}
+
+static void tokenizer_setup(compiler_ctx *ctx, char *code, u32 length, u32 expected_tokens) {
+	tokenizer_reset(ctx);
+	ctx->tokenizer.cursor = ctx->tokenizer.src = code;
+	ctx->tokenizer.code_length = length;
+	ctx->tokenizer.src_capacity = length;
+	ctx->tokenizer.symbol_capacity = 64;
+	ctx->tokenizer.symbols = bump_alloc(ctx, ARENA_FRONT_END, sizeof(identifier) * ctx->tokenizer.symbol_capacity);
+	ctx->tokenizer.symbol_count = 0;
+	ctx->tokenizer.symbol_table_mask = 127;
+	ctx->tokenizer.symbol_table = bump_alloc(ctx, ARENA_FRONT_END, sizeof(u32) * (ctx->tokenizer.symbol_table_mask + 1));
+	__builtin_memset(ctx->tokenizer.symbol_table, 0, sizeof(u32) * (ctx->tokenizer.symbol_table_mask + 1));
+
+	for (u32 i = 0; i < KEYWORD_COUNT; ++i) {
+		char *keyword = (char *)keywords[i];
+		u32 length = 0;
+		while (keyword[length]) length += 1;
+		intern(ctx, keyword, length);
+	}
+	intern(ctx, "main", 4);
+
+	ctx->tokenizer.token_capacity = expected_tokens + 16;
+	ctx->tokenizer.token_types = bump_alloc(ctx, ARENA_FRONT_END, sizeof(u16) * ctx->tokenizer.token_capacity);
+	ctx->tokenizer.token_offsets = bump_alloc(ctx, ARENA_FRONT_END, sizeof(u32) * ctx->tokenizer.token_capacity);
+	ctx->tokenizer.token_values = bump_alloc(ctx, ARENA_FRONT_END, sizeof(u32) * ctx->tokenizer.token_capacity);
+	ctx->tokenizer.token_count = 0;
+}
+
+u32 tokenizer_init(compiler_ctx *ctx, char *code, u32 length) {
+	tokenizer_setup(ctx, code, length, length / 4);
+	while (lex_token(ctx));
+	return ctx->tokenizer.token_count;
+}
+
+// Incremental editing works on the source and tokens left behind by the last
+// tokenizer_init. edit_src_code splices the text and returns the gap the caller
+// writes the inserted bytes into, relex_src_code then re-lexes from the last
+// token before the edit until a new token lands on the start of an old one.
+// Lexing has no state between tokens, so everything after that point is reused
+// and only has its offset shifted.
+
+__attribute__((export_name("edit_src_code")))
+char *edit_src_code(compiler_ctx *ctx, u32 offset, u32 removed_length, u32 inserted_length) {
+	// the last byte is the null terminator and can't be edited
+	if (!ctx->tokenizer.src || offset + removed_length >= ctx->tokenizer.code_length) return 0;
+
+	bump_rewind(ctx);
+
+	char *tail = ctx->tokenizer.src + offset + removed_length;
+	u32 tail_length = ctx->tokenizer.code_length - offset - removed_length;
+	u32 new_length = ctx->tokenizer.code_length - removed_length + inserted_length;
+
+	if (new_length > ctx->tokenizer.src_capacity) {
+		ctx->tokenizer.src_capacity = new_length * 2;
+		char *new_src = bump_alloc(ctx, ARENA_SOURCE, ctx->tokenizer.src_capacity);
+		__builtin_memcpy(new_src, ctx->tokenizer.src, offset);
+		__builtin_memcpy(new_src + offset + inserted_length, tail, tail_length);
+		ctx->tokenizer.src = new_src;
+	} else {
+		__builtin_memmove(ctx->tokenizer.src + offset + inserted_length, tail, tail_length);
+	}
+
+	ctx->tokenizer.code_length = new_length;
+	ctx->tokenizer.edit_offset = offset;
+	ctx->tokenizer.edit_removed_length = removed_length;
+	ctx->tokenizer.edit_inserted_length = inserted_length;
+
+	return ctx->tokenizer.src + offset;
+}
+
+__attribute__((export_name("relex_src_code")))
+u32 relex_src_code(compiler_ctx *ctx) {
+	u32 old_edit_end = ctx->tokenizer.edit_offset + ctx->tokenizer.edit_removed_length;
+	u32 new_edit_end = ctx->tokenizer.edit_offset + ctx->tokenizer.edit_inserted_length;
+	i32 delta = ctx->tokenizer.edit_inserted_length - ctx->tokenizer.edit_removed_length;
+
+	// the first token starting at or after the edit, every token before it is untouched
+	u32 low = 0, high = ctx->tokenizer.token_count;
+	while (low < high) {
+		u32 mid = (low + high) / 2;
+		if (ctx->tokenizer.token_offsets[mid] < ctx->tokenizer.edit_offset) low = mid + 1;
+		else high = mid;
+	}
+
+	// the token in front of the edit is re-lexed too, it may grow into the inserted text
+	u32 first = (low > 0) ? low - 1 : 0;
+	u32 old_count = ctx->tokenizer.token_count;
+	u32 resync = first;
+
+	// new tokens are lexed into the free space after the old ones
+	ctx->tokenizer.cursor = ctx->tokenizer.src + ctx->tokenizer.token_offsets[first];
+	for (;;) {
+		u32 type = lex_token(ctx);
+		u32 offset = ctx->tokenizer.token_offsets[ctx->tokenizer.token_count - 1];
+
+		if (offset >= new_edit_end) {
+			while (resync < old_count && (ctx->tokenizer.token_offsets[resync] < old_edit_end || ctx->tokenizer.token_offsets[resync] + delta < offset)) {
+				resync += 1;
+			}
+
+			if (resync < old_count && ctx->tokenizer.token_offsets[resync] + delta == offset) {
+				ctx->tokenizer.token_count -= 1;
+				break;
+			}
 		}
 
-		if (length == 3 && startswith(start, "int", 3)) {
-			_current_token.type = TOKEN_INT_DECL;
-			return;
+		if (!type) {
+			resync = old_count;
+			break;
 		}
+	}
 
-		if (length == 3 && startswith(start, "for", 3)) {
-			_current_token.type = TOKEN_FOR;
-			return;
+	u32 new_tokens = ctx->tokenizer.token_count - old_count;
+	u32 tail = old_count - resync;
+
+	// place the reused tail after the new tokens, then slide both down into place
+	reserve_tokens(ctx, ctx->tokenizer.token_count + tail);
+	move_tokens(ctx, ctx->tokenizer.token_count, resync, tail);
+	for (u32 i = ctx->tokenizer.token_count; i < ctx->tokenizer.token_count + tail; ++i) {
+		ctx->tokenizer.token_offsets[i] += delta;
+	}
+	move_tokens(ctx, first, old_count, new_tokens + tail);
+
+	ctx->tokenizer.token_count = first + new_tokens + tail;
+	ctx->tokenizer.token_index = 0;
+
+	bump_set_mark(ctx);
+	return new_tokens;
+}
+
+// Parallel lexing splits the source at line starts and scans every chunk into
+// its own buffers with lex_chunk, which can run on as many threads as there
+// are chunks. A split can land inside a block comment, so lex_parallel_end
+// only trusts a chunk once one of its tokens starts exactly where the previous
+// chunk's tokens ended, the same resync rule relex_src_code uses. Chunks that
+// never line up, or that ran out of room, are finished by the serial lexer.
+
+struct chunk {
+	u32 start;
+	u32 end;
+	u16 *types;
+	u32 *offsets;
+	u32 *values;
+	u32 count;
+	u32 capacity;
+	u32 next_offset; // where the first token that wasn't stored starts
+	bool overflowed;
+};
+
+#ifdef __wasm_atomics__
+// In the threaded build (compile.ps1 -threads) every worker instance shares the
+// linear memory, so each one moves its __stack_pointer onto a stack of its own,
+// taken from the heap when the worker starts. compile_chunk parses on the
+// workers too, which recurses as deep as the main thread.
+#define WORKER_STACK_SIZE 65536
+
+__attribute__((export_name("worker_stack_top")))
+u8 *worker_stack_top() {
+	return (u8 *)heap_alloc(WORKER_STACK_SIZE) + WORKER_STACK_SIZE;
+}
+#endif
+
+__attribute__((export_name("lex_parallel_begin")))
+u32 lex_parallel_begin(compiler_ctx *ctx, char *code, u32 length, u32 requested_chunks) {
+	tokenizer_setup(ctx, code, length, 0);
+
+	ctx->tokenizer.chunks = bump_alloc(ctx, ARENA_AST, sizeof(chunk) * requested_chunks);
+	ctx->tokenizer.chunk_count = 0;
+
+	char *end = ctx->tokenizer.src + ctx->tokenizer.code_length;
+	u32 start = 0;
+	for (u32 i = 0; i < requested_chunks && start < ctx->tokenizer.code_length; ++i) {
+		u32 split = ctx->tokenizer.code_length;
+		if (i + 1 < requested_chunks) {
+			char *line_end = find_line_end(ctx->tokenizer.src + max(start, (u32)((u64)ctx->tokenizer.code_length * (i + 1) / requested_chunks)), end);
+			split = min((u32)(line_end - ctx->tokenizer.src) + 1, ctx->tokenizer.code_length);
 		}
 
-		if (length == 4 && startswith(start, "else", 4)) {
-			_current_token.type = TOKEN_ELSE;
+		chunk *k = ctx->tokenizer.chunks + ctx->tokenizer.chunk_count++;
+		k->start = start;
+		k->count = 0;
+		k->overflowed = false;
+		// the last chunk also owns the end token, which can sit right at code_length
+		k->end = (split == ctx->tokenizer.code_length) ? ctx->tokenizer.code_length + 1 : split;
+		k->capacity = (split - start) / 2 + 16;
+		k->types = bump_alloc(ctx, ARENA_AST, sizeof(u16) * k->capacity);
+		k->offsets = bump_alloc(ctx, ARENA_AST, sizeof(u32) * k->capacity);
+		k->values = bump_alloc(ctx, ARENA_AST, sizeof(u32) * k->capacity);
+		start = split;
+	}
+
+	return ctx->tokenizer.chunk_count;
+}
+
+__attribute__((export_name("lex_chunk")))
+void lex_chunk(compiler_ctx *ctx, u32 index) {
+	chunk *k = ctx->tokenizer.chunks + index;
+	char *cursor = ctx->tokenizer.src + k->start;
+	char *end = ctx->tokenizer.src + ctx->tokenizer.code_length;
+
+	for (;;) {
+		scanned_token t = scan_token(&cursor, end);
+		u32 offset = t.start - ctx->tokenizer.src;
+
+		if (offset >= k->end || k->count == k->capacity) {
+			k->next_offset = offset;
+			k->overflowed = offset < k->end;
 			return;
 		}
 
-		if (length == 5 && startswith(start, "while", 5)) {
-			_current_token.type = TOKEN_WHILE;
+		k->types[k->count] = t.type;
+		k->offsets[k->count] = offset;
+		k->values[k->count] = t.value;
+		k->count += 1;
+
+		if (!t.type) {
+			k->next_offset = ctx->tokenizer.code_length + 1;
 			return;
 		}
+	}
+}
 
-		if (length == 6 && startswith(start, "return", 6)) {
-			_current_token.type = TOKEN_RETURN;
-			return;
+// serially lexes from `offset` and returns where the first token at or past `limit` starts
+static u32 lex_range(compiler_ctx *ctx, u32 offset, u32 limit) {
+	ctx->tokenizer.cursor = ctx->tokenizer.src + offset;
+	for (;;) {
+		char *start = ctx->tokenizer.cursor;
+		scanned_token t = scan_token(&ctx->tokenizer.cursor, ctx->tokenizer.src + ctx->tokenizer.code_length);
+		u32 token_offset = t.start - ctx->tokenizer.src;
+
+		if (token_offset >= limit) {
+			ctx->tokenizer.cursor = start;
+			return token_offset;
 		}
 
-		return;
+		push_scanned_token(ctx, t);
+		if (!t.type) return ctx->tokenizer.code_length + 1;
 	}
+}
 
-	if (startswith(c, "==", 2)) {
-		_current_token.type = TOKEN_EQ;
-		c += 2;
-		return;
-	}
+__attribute__((export_name("lex_parallel_end")))
+u32 lex_parallel_end(compiler_ctx *ctx) {
+	u32 total = 0;
+	for (u32 i = 0; i < ctx->tokenizer.chunk_count; ++i) total += ctx->tokenizer.chunks[i].count;
+	reserve_tokens(ctx, total + 1);
 
-	if (startswith(c, "!=", 2)) {
-		_current_token.type = TOKEN_NE;
-		c += 2;
-		return;
-	}
+	// where the next token of the real stream starts
+	u32 expected = 0;
+
+	for (u32 i = 0; i < ctx->tokenizer.chunk_count; ++i) {
+		chunk *k = ctx->tokenizer.chunks + i;
+		if (expected >= k->end) continue;
+
+		u32 first = 0;
+		while (first < k->count && k->offsets[first] < expected) first += 1;
 
-	if (startswith(c, ">=", 2)) {
-		_current_token.type = TOKEN_GE;
-		c += 2;
-		return;
+		bool in_sync = (first < k->count) ? k->offsets[first] == expected : k->next_offset == expected;
+		if (!in_sync) {
+			expected = lex_range(ctx, expected, k->end);
+			continue;
+		}
+
+		for (u32 j = first; j < k->count; ++j) {
+			push_scanned_token(ctx, (scanned_token){ k->types[j], ctx->tokenizer.src + k->offsets[j], k->values[j] });
+		}
+		expected = k->next_offset;
+
+		if (k->overflowed) {
+			expected = lex_range(ctx, expected, k->end);
+		}
 	}
 
-	if (startswith(c, "<=", 2)) {
-		_current_token.type = TOKEN_LE;
-		c += 2;
-		return;
+	// an empty source never reaches a chunk
+	if (!ctx->tokenizer.token_count || ctx->tokenizer.token_types[ctx->tokenizer.token_count - 1] != 0) {
+		push_token(ctx, 0, ctx->tokenizer.code_length, 0);
 	}
 
-	c += 1;
+	bump_reset(ctx, ARENA_AST);
+	bump_set_mark(ctx);
+	return ctx->tokenizer.token_count;
 }
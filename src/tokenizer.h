@@ -29,23 +29,56 @@ enum identifier_type {
 	IDENTIFIER_PARAM
 };
 
-typedef struct token token;
-typedef struct token_list token_list;
-
-struct token {
-	u32 type;
-	u32 line_number;
-	union {
-		u32 value;
-		identifier identifier;
-	};
+typedef struct chunk chunk;
+
+typedef struct tokenizer_state tokenizer_state;
+struct tokenizer_state {
+	char *cursor; // where lex_token scans next
+	char *src;
+	u32 code_length;
+	u32 src_capacity;
+
+	// The whole file is lexed up front into these parallel arrays, the parser
+	// then walks them with peek()/advance_token(). The last token is always 0.
+	u16 *token_types;
+	u32 *token_offsets;
+	u32 *token_values;
+	u32 token_count;
+	u32 token_capacity;
+	u32 token_index;
+
+	identifier *symbols;
+	u32 symbol_count;
+	u32 symbol_capacity;
+
+	// open addressing, stores symbol id + 1 so 0 marks an empty slot
+	u32 *symbol_table;
+	u32 symbol_table_mask;
+
+	char error_msg[128];
+	u32 error_msg_len;
+
+	u32 edit_offset;
+	u32 edit_removed_length;
+	u32 edit_inserted_length;
+
+	chunk *chunks;
+	u32 chunk_count;
 };
 
-void tokenizer_init(char *code, u32 length);
-token current_token();
-void advance_token();
+u32 tokenizer_init(compiler_ctx *ctx, char *code, u32 length);
+void tokenizer_reset(compiler_ctx *ctx);
+token_type peek(compiler_ctx *ctx, u32 n);
+u32 peek_value(compiler_ctx *ctx, u32 n);
+void advance_token(compiler_ctx *ctx);
+void advance_tokens(compiler_ctx *ctx, u32 n);
+u32 token_position(compiler_ctx *ctx);
+void seek_token(compiler_ctx *ctx, u32 index);
+identifier symbol_name(compiler_ctx *ctx, u32 symbol);
+// main is interned right after the keywords, so its id is known up front
+#define SYMBOL_MAIN 7
 void unexpected_token_error(token_type t);
-void expected_identifier(identifier_type type);
-void redeclaration_error(identifier_type type);
-void not_found_error(identifier_type type);
-void set_error_msg(char *format_str, ...);
+void expected_identifier(compiler_ctx *ctx, identifier_type type);
+void redeclaration_error(compiler_ctx *ctx, identifier_type type, u32 symbol);
+void not_found_error(compiler_ctx *ctx, identifier_type type, u32 symbol);
+void set_error_msg(compiler_ctx *ctx, char *format_str, ...);